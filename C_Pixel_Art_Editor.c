@@ -5,12 +5,41 @@ Features:
 - Simple pixel-editor using SDL2
 - Click to paint pixels on a grid
 - Right-click to erase
+- Round/square brushes of configurable radius: '-' and '=' change size, 'b' toggles shape
+- Tools: 'p' pencil, 'n' line, 'r' rectangle, 'e' ellipse (Shift+'r'/'e' for filled);
+  shapes are previewed as an overlay and written to the canvas on release
+- Rectangle selection with 'q'; Ctrl+B turns the selection into a custom brush
+  (index 0 is transparent), 'b' goes back to the round/square brush
+- 'o' rotates the selection by any angle (RotSprite-style): drag around it, Shift snaps
+  to 15 degrees, release or Enter applies, Escape cancels
+- Fill tool 'f'; Shift+'f' cycles solid / Bayer dither / custom-brush tile fills,
+  ',' and '.' change the dither level, right-click in the palette picks the second color
+- Canvas transforms: 'h' / 'v' flip, 't' rotates 90 degrees (Shift+'t' the other way),
+  Ctrl+arrows shift with wrap-around (Shift for 8 cells), Ctrl+'r' resizes (prompts in console)
+- Tile mode with 'w': strokes wrap around the edges and the canvas is shown 3x3
+- Symmetry painting with 'm' (off / left-right / top-bottom / 4-way)
+- Undo/redo with Ctrl+Z / Ctrl+Y
+- Several documents open at once: Ctrl+N opens one (prompts for its size), Tab / Shift+Tab
+  switch, Ctrl+W closes; each has its own canvas, palette, history and view, allocated
+  from a per-document arena
+- Sparse artwork is kept run-length encoded where it is not being edited: documents in
+  the background, undo snapshots and the workspace cache
 - Click palette to change current color, or number keys 1-9
 - Save canvas as BMP with key 's' (prompts filename in console)
+- Pixel-art upscaling on export (Scale2x, Scale3x, xBR 2x): 'x' cycles the filter
 - Load BMP with key 'l' (prompts filename in console) and maps it into the grid
+- Reference image for tracing with 'i' (prompts filename in console), drawn half
+  transparent; Shift+'i' puts it under / over the canvas or hides it
+- Navigator below the palette: the whole canvas at reduced size with the visible part outlined
+- Actual-size preview window with 'a' (cycles off / 1x / 2x), updated from the same
+  changed regions as the main view
+- Rendering runs on its own thread, fed frame by frame through a lock-free
+  queue, so input is handled while the renderer waits for vsync
 - Clear canvas with 'c'
 - Toggle grid lines with 'g'
-- Resize cells by +/- with '[' and ']' (recreates window)
+- Zoom with '[' and ']' or the mouse wheel in quarter-octave steps, pan with the middle
+  mouse button; the window keeps its size and is HiDPI aware. Below one pixel per cell
+  the canvas is drawn from a mipmap pyramid
 
 Build (Linux/macOS/WSL):
   gcc c_pixel_editor.c -o c_pixel_editor `sdl2-config --cflags --libs`
@@ -21,254 +50,4998 @@ Windows (MinGW):
 Requires: SDL2 development libraries.
 
 Usage:
-  Run the program. Use mouse to draw on the grid. Press keys for actions.
+  c_pixel_editor [cells_x cells_y] [--filter none|scale2x|scale3x|epx|xbr2x] [--threads n]
+                 [--no-render-thread] [--workspace dir] [--mem-budget mb]
+                 [--map-dir dir] [--map-threshold mb] [--bench-filters] [--bench-threads]
+                 [--bench-layout] [--journal file] [--timelapse journal out] [--every n] [--scale k]
+  Use mouse to draw on the grid. Press keys for actions.
+  Each side of the grid may be 1..1048576 cells; larger or malformed sizes are rejected.
+  --bench-filters prints the throughput of each export filter and exits.
+  Save and load reuse their scratch buffers; their high-water marks are printed on exit.
+  --bench-layout compares row-major and Morton-tiled cell layouts on 2D-local access and exits.
+  --workspace indexes the BMP files of a directory (Ctrl+P opens one, PageUp / PageDown
+  step through them); open documents are kept within --mem-budget megabytes (default 256)
+  by evicting the least recently used ones to a raw cache in the directory. F2 shows the
+  workspace as thumbnails (click opens, wheel / PageUp / PageDown scroll), generated on
+  worker threads and cached on disk by content hash.
+  --map-dir places canvases and undo steps of at least --map-threshold megabytes (default
+  64) in temporary files mapped into memory, so canvases larger than RAM can be edited;
+  only the regions being painted, drawn or saved stay resident. For such canvases the
+  renderer is only sent the cells in view and the actual-size preview is not available.
+  --journal appends every stroke, undo and redo to an edit log. --timelapse replays such a
+  log without a window and writes a frame every --every operations (default 10) with each
+  cell as --scale pixels (default 4): an animated GIF when out ends in .gif, otherwise a
+  numbered BMP sequence out_00001.bmp, out_00002.bmp, ... Each frame only carries the
+  cells changed since the previous one.
 
 Notes:
 - This is a compact educational program showing common C idioms: arrays, malloc/free, file I/O (via SDL), pointers, and simple UI loop.
 - The file is intentionally single-file to make it easy to explore and modify.
 */
 
+#ifndef _WIN32
+/* mkstemp, ftruncate and mmap are POSIX, not C99: declare them under -std=c99 too */
+#define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE
+#endif
 #include <SDL.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <math.h>
+#include <limits.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <direct.h>
+#else
+#include <dirent.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#include <sys/stat.h>
 
 /* Configuration */
 static int CELLS_X = 32;
 static int CELLS_Y = 32;
-static int CELL_SIZE = 16;
+/* Zoom is 2^(zoom_level/4) window points per cell, so four steps double it.
+   Zooming and panning only change how the canvas is mapped into the window:
+   the window keeps its size, and on HiDPI displays the renderer scales
+   points to output pixels. */
+static int zoom_level = 16;
+static double zoom = 16.0;
+#define ZOOM_LEVEL_MIN (-24)
+#define ZOOM_LEVEL_MAX 24
+static double pan_x = 0, pan_y = 0; /* window position of the view's top-left corner */
+static int view_w = 0, view_h = 0;  /* window size in points */
+#define PANEL_W 200 /* palette and navigator, at the right edge of the window */
 #define PALETTE_COUNT 12 /* number of palette colors */
+#define BRUSH_MAX_RADIUS 32
 
 /* Globals */
 static uint8_t *canvas = NULL; /* each cell stores palette index (0..PALETTE_COUNT-1) */
 static SDL_Color palette[PALETTE_COUNT];
+static uint32_t palette_argb[PALETTE_COUNT]; /* palette packed for the canvas texture */
 static int current_color = 1; /* default non-zero color */
+static int secondary_color = 0; /* right-click in the palette; second dither color */
 static int show_grid = 1;
+static int tile_mode = 0; /* seamless tiles: painting wraps around the edges, view shows 3x3 copies */
+
+/* Tools */
+enum { TOOL_PENCIL = 0, TOOL_LINE, TOOL_RECT, TOOL_ELLIPSE, TOOL_SELECT, TOOL_FILL };
+static int current_tool = TOOL_PENCIL;
+static int shape_filled = 0; /* rect/ellipse: filled or outline */
+
+/* Brush: rasterized once into one span per row (relative to the brush center) */
+enum { BRUSH_ROUND = 0, BRUSH_SQUARE = 1 };
+typedef struct { int dy, x0, x1; } StampSpan; /* x0..x1 inclusive */
+static int brush_radius = 0; /* 0 = single cell */
+static int brush_shape = BRUSH_ROUND;
+static StampSpan brush_stamp[2*BRUSH_MAX_RADIUS+1];
+static int brush_stamp_rows = 0;
+
+/* Custom brush captured from the selection. Index 0 is transparent, so the
+   brush is kept as a list of opaque runs and stamped with one memcpy per run. */
+typedef struct { int dy, dx, len; size_t off; } BrushRun; /* off: index into pixels */
+static struct {
+    int w, h;
+    uint8_t *pixels;
+    BrushRun *runs;
+    int nruns;
+} custom_brush = { 0, 0, NULL, NULL, 0 };
+static int use_custom_brush = 0;
+
+/* Fill tool: solid, two-color ordered (Bayer) dither, or the custom brush as a repeating tile */
+enum { FILL_SOLID = 0, FILL_DITHER, FILL_PATTERN };
+static int fill_mode = FILL_SOLID;
+static int dither_level = 8; /* 0..16: share of secondary_color in a dither fill */
+static uint8_t *fill_seen = NULL; /* per cell: already part of the filled region */
+static size_t fill_seen_size = 0;
+static int *fill_stack = NULL; /* pending seeds as x,y pairs */
+static int fill_stack_len = 0, fill_stack_cap = 0;
+/* Pattern rows: each of the pattern_h rows holds the pattern repeated across
+   the canvas width plus one period, so any span is one memcpy starting at
+   x0 % pattern_w */
+static uint8_t *pattern_rows = NULL;
+static int pattern_w = 0, pattern_h = 0, pattern_stride = 0;
+
+/* Rectangular selection (cell coordinates, inclusive once normalized) */
+static int sel_active = 0, selecting = 0;
+static int sel_x0, sel_y0, sel_x1, sel_y1;
+
+/* Stroke state: last cell painted, so motion events can be joined by a line */
+static int stroke_x = 0, stroke_y = 0;
+static uint8_t stroke_color = 0;
+
+/* Symmetry: painted spans are mirrored about the canvas center lines */
+enum { SYM_NONE = 0, SYM_H, SYM_V, SYM_4 };
+static int symmetry = SYM_NONE;
+
+/* Shape tool state: anchor and current corner while the mouse is held */
+static int shape_active = 0;
+static int shape_x0, shape_y0, shape_x1, shape_y1;
+static uint8_t shape_color = 0;
+static int shape_version = 0; /* bumped whenever the preview spans change */
+
+/* Per-row [min,max] accumulator used to merge overlapping stamps of one segment */
+static int *row_min = NULL;
+static int *row_max = NULL;
+static int row_cap = 0;
+static int row_base = 0, row_count = 0;
+
+/* Rasterized geometry: a list of row spans, either applied to the canvas or
+   drawn as a preview overlay */
+typedef struct { int y, x0, x1; } Span; /* x0..x1 inclusive, unclipped */
+static Span *spans = NULL;
+static int span_count = 0, span_cap = 0;
+
+/* Cell rectangle, inclusive on both ends */
+typedef struct { int x0, y0, x1, y1; } Box;
+static Box span_boxes[16]; /* bounding box of each mirrored (and wrapped) copy in the span list */
+static int span_box_count = 0;
+
+/* Regions of the canvas changed since the last frame handed to the renderer.
+   Dirty boxes are coalesced so overlapping edits upload once, while distant
+   ones (e.g. mirrored strokes) don't balloon into one huge rectangle. */
+#define DIRTY_MAX 8
+static Box dirty[DIRTY_MAX];
+static int dirty_count = 0;
+
+/* Undo history: each record keeps the before/after contents of the tiles an
+   edit touched, so an edit costs memory proportional to its area. A tile
+   snapshot is stored as an RLE blob when that is smaller, which for line art
+   on a plain background is most of them. */
+#define TILE_SIZE 64
+#define TILE_BYTES (TILE_SIZE*TILE_SIZE)
+#define HISTORY_MAX 64
+typedef struct {
+    int ntiles;
+    int *tiles;       /* tile index = ty*tiles_x + tx */
+    size_t *snap;     /* 2*ntiles+1 offsets into data: tile i before is snapshot i, after is ntiles+i */
+    uint8_t *data;    /* a snapshot of TILE_BYTES is raw (row stride TILE_SIZE), a shorter one an RLE blob */
+} UndoRecord;
+static UndoRecord history[HISTORY_MAX];
+static int history_count = 0, history_pos = 0;
+static int edit_active = 0;
+static int edit_failed = 0;       /* tiles could not be saved: the rest of the edit is dropped */
+static uint8_t *edit_seen = NULL; /* per tile: saved in the current edit */
+static int edit_seen_count = 0;
+static int *edit_tiles = NULL;
+static uint8_t *edit_before = NULL;
+static uint8_t *edit_after = NULL;   /* scratch for the after snapshots in edit_end */
+static int edit_ntiles = 0, edit_cap = 0, edit_after_cap = 0;
+static size_t *edit_snap = NULL;     /* scratch for snapshot offsets in edit_end */
+
+/* File-backed memory (--map-dir dir). Allocations of at least map_threshold
+   bytes are placed in a temporary file mapped into memory instead of on the
+   heap, so the OS pages them in and out on demand: a canvas larger than RAM
+   only keeps the parts being painted, drawn or saved resident. The file is
+   deleted as soon as it is created (on close on Windows), so nothing is left
+   behind. A fresh mapping reads as zeros without touching its pages. */
+static char map_dir[1024] = "";
+static size_t map_threshold = (size_t)64 << 20;
+typedef struct {
+    void *base;       /* NULL when not mapped */
+    size_t size;
+#ifdef _WIN32
+    HANDLE file, mapping;
+#endif
+} MapRegion;
+
+static int map_create(MapRegion *m, size_t size) {
+    memset(m, 0, sizeof(*m));
+    if (!map_dir[0] || size == 0) return -1;
+#ifdef _WIN32
+    char name[MAX_PATH];
+    if (!GetTempFileNameA(map_dir, "pxl", 0, name)) return -1;
+    m->file = CreateFileA(name, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                          FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+    if (m->file == INVALID_HANDLE_VALUE) { DeleteFileA(name); return -1; }
+    m->mapping = CreateFileMappingA(m->file, NULL, PAGE_READWRITE,
+                                    (DWORD)((unsigned long long)size >> 32), (DWORD)size, NULL);
+    if (m->mapping) m->base = MapViewOfFile(m->mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+    if (!m->base) {
+        if (m->mapping) CloseHandle(m->mapping);
+        CloseHandle(m->file);
+        memset(m, 0, sizeof(*m));
+        return -1;
+    }
+#else
+    char name[1100];
+    snprintf(name, sizeof(name), "%s/pixel-map-XXXXXX", map_dir);
+    int fd = mkstemp(name);
+    if (fd < 0) return -1;
+    unlink(name);
+    void *p = MAP_FAILED;
+    if (ftruncate(fd, (off_t)size) == 0) p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) return -1;
+#ifdef MADV_RANDOM
+    madvise(p, size, MADV_RANDOM); /* painting touches scattered rows, do not read ahead */
+#endif
+    m->base = p;
+#endif
+    m->size = size;
+    return 0;
+}
+
+static void map_destroy(MapRegion *m) {
+    if (!m->base) return;
+#ifdef _WIN32
+    UnmapViewOfFile(m->base);
+    CloseHandle(m->mapping);
+    CloseHandle(m->file);
+#else
+    munmap(m->base, m->size);
+#endif
+    memset(m, 0, sizeof(*m));
+}
+
+/* Arena allocator. Each document owns an arena holding its canvas, undo
+   records and per-document scratch, so closing a document frees all of it
+   with one arena_free. Small allocations are bumped out of ARENA_BLOCK sized
+   blocks taken from a pool shared by every arena, so a closed document's
+   blocks are reused by the next one instead of going back to the heap; large
+   ones get a block of their own. Each block counts its live allocations and
+   goes back to the pool as soon as they have all been released, so undo
+   history that keeps dropping its oldest steps does not grow the arena.
+   With --map-dir, large blocks are file-backed; they do not count towards
+   bytes, which is what the workspace budget measures. */
+#define ARENA_BLOCK (256 * 1024)
+#define ARENA_POOL_MAX 32
+#define ARENA_ALIGN 16
+#define ARENA_ROUND(n) (((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+typedef struct ArenaBlock {
+    struct ArenaBlock *prev, *next;
+    size_t size, used; /* payload bytes */
+    int live;          /* allocations not yet released */
+    MapRegion map;     /* file-backed block: the mapping starts with this header */
+} ArenaBlock;
+typedef struct {
+    ArenaBlock *blocks;
+    ArenaBlock *cur;   /* standard block being bumped */
+    size_t bytes;      /* payload bytes of all blocks */
+} Arena;
+#define ARENA_BLOCK_HDR ARENA_ROUND(sizeof(ArenaBlock))
+#define ARENA_ALLOC_HDR ARENA_ROUND(sizeof(ArenaBlock*)) /* each allocation starts with its block */
+static ArenaBlock *arena_pool = NULL;
+static int arena_pool_count = 0;
+
+static void arena_drop_block(Arena *a, ArenaBlock *b) {
+    if (b->prev) b->prev->next = b->next; else a->blocks = b->next;
+    if (b->next) b->next->prev = b->prev;
+    if (a->cur == b) a->cur = NULL;
+    if (b->map.base) {
+        MapRegion m = b->map; /* b itself goes away with the mapping */
+        map_destroy(&m);
+        return;
+    }
+    a->bytes -= b->size;
+    if (b->size == ARENA_BLOCK && arena_pool_count < ARENA_POOL_MAX) {
+        b->next = arena_pool;
+        arena_pool = b;
+        arena_pool_count++;
+    } else free(b);
+}
+
+static ArenaBlock *arena_new_block(Arena *a, size_t size) {
+    ArenaBlock *b;
+    if (size == ARENA_BLOCK && arena_pool) {
+        b = arena_pool;
+        arena_pool = b->next;
+        arena_pool_count--;
+    } else {
+        MapRegion m;
+        if (size >= map_threshold && map_create(&m, ARENA_BLOCK_HDR + size) == 0) {
+            b = (ArenaBlock*)m.base;
+            b->map = m;
+        } else {
+            b = (ArenaBlock*)malloc(ARENA_BLOCK_HDR + size);
+            if (!b) return NULL;
+            b->map.base = NULL;
+        }
+    }
+    b->size = size; b->used = 0; b->live = 0;
+    b->prev = NULL; b->next = a->blocks;
+    if (a->blocks) a->blocks->prev = b;
+    a->blocks = b;
+    if (!b->map.base) a->bytes += size;
+    return b;
+}
+
+/* n bytes aligned to ARENA_ALIGN, uninitialized; NULL when out of memory */
+static void *arena_alloc(Arena *a, size_t n) {
+    size_t need = ARENA_ALLOC_HDR + ARENA_ROUND(n);
+    ArenaBlock *b;
+    if (need > ARENA_BLOCK / 4) b = arena_new_block(a, need);
+    else {
+        if (!a->cur || a->cur->used + need > a->cur->size) a->cur = arena_new_block(a, ARENA_BLOCK);
+        b = a->cur;
+    }
+    if (!b) return NULL;
+    uint8_t *p = (uint8_t*)b + ARENA_BLOCK_HDR + b->used;
+    b->used += need;
+    b->live++;
+    *(ArenaBlock**)p = b;
+    return p + ARENA_ALLOC_HDR;
+}
+
+/* Release one allocation of a; its block is recycled once all of them are */
+static void arena_release(Arena *a, void *p) {
+    if (!p) return;
+    ArenaBlock *b = *(ArenaBlock**)((uint8_t*)p - ARENA_ALLOC_HDR);
+    if (--b->live > 0) return;
+    if (b == a->cur) b->used = 0;
+    else arena_drop_block(a, b);
+}
+
+/* Release everything allocated from a */
+static void arena_free(Arena *a) {
+    while (a->blocks) arena_drop_block(a, a->blocks);
+}
+
+/* n zeroed bytes; a file-backed block is zero already, so its pages stay untouched */
+static void *arena_calloc(Arena *a, size_t n) {
+    uint8_t *p = (uint8_t*)arena_alloc(a, n);
+    if (p && !(*(ArenaBlock**)(p - ARENA_ALLOC_HDR))->map.base) memset(p, 0, n);
+    return p;
+}
+
+static void arena_pool_free() {
+    while (arena_pool) {
+        ArenaBlock *b = arena_pool;
+        arena_pool = b->next;
+        free(b);
+    }
+    arena_pool_count = 0;
+}
+
+/* Run-length encoding for sparse artwork (mostly background). A blob is
+   self-contained, so it can sit in an arena, an undo record or a file:
+   RleHeader, then row_first[h+1] (index of each row's first run), the start
+   x of every run, then the color of every run. The row index lets any band
+   of rows be decoded on its own, so blobs are expanded in parallel. Parked
+   documents, undo tile snapshots and the
+   workspace cache use it whenever the blob is small enough; tools always
+   work on the flat canvas. */
+#define RLE_RATIO 4 /* parked documents are encoded at 1/RLE_RATIO of the flat size or less */
+typedef struct { uint32_t w, h, nruns, pad; } RleHeader;
+
+static size_t rle_bytes(int h, size_t nruns) {
+    return sizeof(RleHeader) + sizeof(uint32_t) * ((size_t)h + 1 + nruns) + nruns;
+}
+
+/* Blob size for a w x h block of cells with the given row stride, or 0 when
+   it would exceed limit bytes (counting stops as soon as it does) */
+static size_t rle_size(const uint8_t *cells, int w, int h, size_t stride, size_t limit) {
+    size_t n = 0;
+    for (int y=0;y<h;y++){
+        const uint8_t *row = cells + (size_t)y * stride;
+        n++;
+        for (int x=1;x<w;x++) n += row[x] != row[x-1];
+        if (n > UINT32_MAX || rle_bytes(h, n) > limit) return 0;
+    }
+    return rle_bytes(h, n);
+}
+
+static void rle_encode(uint8_t *dst, const uint8_t *cells, int w, int h, size_t stride) {
+    RleHeader *hd = (RleHeader*)dst;
+    uint32_t *first = (uint32_t*)(hd + 1), *xs = first + h + 1, n = 0;
+    for (int y=0;y<h;y++){
+        const uint8_t *row = cells + (size_t)y * stride;
+        first[y] = n;
+        xs[n++] = 0;
+        for (int x=1;x<w;x++) if (row[x] != row[x-1]) xs[n++] = (uint32_t)x;
+    }
+    first[h] = n;
+    uint8_t *colors = (uint8_t*)(xs + n);
+    for (int y=0;y<h;y++)
+        for (uint32_t r=first[y]; r<first[y+1]; r++) colors[r] = cells[(size_t)y * stride + xs[r]];
+    hd->w = (uint32_t)w; hd->h = (uint32_t)h; hd->nruns = n; hd->pad = 0;
+}
+
+/* Expand rows y0..y1-1 of a blob into cells (row 0 of the blob at cells) */
+static void rle_decode_rows(const uint8_t *src, uint8_t *cells, size_t stride, int y0, int y1) {
+    const RleHeader *hd = (const RleHeader*)src;
+    const uint32_t *first = (const uint32_t*)(hd + 1), *xs = first + hd->h + 1;
+    const uint8_t *colors = (const uint8_t*)(xs + hd->nruns);
+    for (int y=y0;y<y1;y++){
+        uint8_t *row = cells + (size_t)y * stride;
+        for (uint32_t r=first[y]; r<first[y+1]; r++){
+            uint32_t end = r + 1 < first[y+1] ? xs[r+1] : hd->w;
+            memset(row + xs[r], colors[r], end - xs[r]);
+        }
+    }
+}
+
+/* Blobs read from a file (journal, workspace cache): check the runs before expanding them */
+static int rle_valid(const uint8_t *src, size_t len, int w, int h) {
+    const RleHeader *hd = (const RleHeader*)src;
+    if (len < sizeof(RleHeader) || hd->w != (uint32_t)w || hd->h != (uint32_t)h ||
+        hd->nruns > len || rle_bytes(h, hd->nruns) > len) return 0; /* undo snapshots are padded */
+    const uint32_t *first = (const uint32_t*)(hd + 1), *xs = first + h + 1;
+    if (first[0] != 0 || first[h] != hd->nruns) return 0;
+    for (int y=0;y<h;y++){
+        if (first[y+1] <= first[y] || first[y+1] > hd->nruns || xs[first[y]] != 0) return 0;
+        for (uint32_t r=first[y]+1; r<first[y+1]; r++) if (xs[r] <= xs[r-1] || xs[r] >= (uint32_t)w) return 0;
+    }
+    const uint8_t *colors = (const uint8_t*)(xs + hd->nruns);
+    for (uint32_t r=0; r<hd->nruns; r++) if (colors[r] >= PALETTE_COUNT) return 0;
+    return 1;
+}
+
+/* Every cell of a w x h block (row stride) is a palette index */
+static int cells_valid(const uint8_t *cells, int w, int h, size_t stride) {
+    for (int y=0;y<h;y++){
+        const uint8_t *row = cells + (size_t)y * stride;
+        for (int x=0;x<w;x++) if (row[x] >= PALETTE_COUNT) return 0;
+    }
+    return 1;
+}
+
+typedef struct { const uint8_t *src; uint8_t *cells; size_t stride; } RleJob;
+
+static void rle_band(void *ctx, int y0, int y1) {
+    RleJob *j = (RleJob*)ctx;
+    rle_decode_rows(j->src, j->cells, j->stride, y0, y1);
+}
+
+/* Open documents. The active document lives in the globals above; the
+   others are parked in their slot until doc_switch swaps them back in. Its
+   arena always stays in the slot. */
+#define DOC_MAX 8
+typedef struct {
+    char name[64];
+    Arena arena;
+    uint8_t *canvas;
+    uint8_t *rle;        /* parked sparse canvas as an RLE blob, canvas is NULL meanwhile */
+    int cells_x, cells_y;
+    SDL_Color palette[PALETTE_COUNT];
+    UndoRecord history[HISTORY_MAX];
+    int history_count, history_pos;
+    uint8_t *edit_seen;
+    int edit_seen_count;
+    int sel_active, sel_x0, sel_y0, sel_x1, sel_y1;
+    int zoom_level;
+    double pan_x, pan_y;
+    int ws_entry;        /* workspace entry it was opened from, -1 if none */
+    unsigned last_use;   /* doc_clock when last made active */
+} Document;
+static Document docs[DOC_MAX];
+static int doc_count = 1, doc_cur = 0;
+static unsigned doc_clock = 0;
+
+static Arena *doc_arena() { return &docs[doc_cur].arena; }
+
+/* Workspace (--workspace dir) entries, one per BMP file, in name order */
+enum { THUMB_NONE, THUMB_QUEUED, THUMB_READY, THUMB_SENT };
+typedef struct {
+    char name[256];
+    int cached;                 /* evicted: cells are in the cache directory */
+    SDL_atomic_t thumb_state;   /* THUMB_*; a worker owns the fields below while THUMB_QUEUED */
+    uint32_t *thumb_px;         /* THUMB_READY: thumb_w x thumb_h ARGB pixels */
+    int thumb_w, thumb_h;
+    int known;                  /* hash, size and mtime are valid */
+    uint64_t hash;              /* of the index data and palette */
+    long long size, mtime;      /* of the file the hash was computed from */
+} WsEntry;
+static struct {
+    char dir[1024];
+    WsEntry *entries;
+    int count, cap;
+    size_t budget;
+} ws = { "", NULL, 0, 0, (size_t)256 << 20 };
+static int browser = 0, browser_top = 0;
+
+/* Grid limits. Cell coordinates stay int, with each side capped far enough
+   below INT_MAX that filtered and scaled export sizes cannot wrap; cell
+   counts and offsets into the canvas are size_t. */
+#define CELLS_SIDE_MAX (1 << 20)
+
+/* Nonzero when a w x h grid is within the limits and its 32-bit export
+   buffer can be addressed (this is what bounds 32-bit builds) */
+static int dims_valid(int w, int h) {
+    return w > 0 && h > 0 && w <= CELLS_SIDE_MAX && h <= CELLS_SIDE_MAX &&
+           (uint64_t)w * (uint64_t)h <= SIZE_MAX / sizeof(uint32_t);
+}
 
 /* Helpers */
+static size_t cell_count() {
+    return (size_t)CELLS_X * CELLS_Y;
+}
+
 static void ensure_canvas_allocated() {
     if (canvas) return;
-    canvas = (uint8_t*)calloc(CELLS_X * CELLS_Y, sizeof(uint8_t));
+    canvas = (uint8_t*)arena_calloc(doc_arena(), cell_count());
     if (!canvas) {
         fprintf(stderr, "Failed to allocate canvas\n");
         exit(1);
     }
 }
 
+static void pack_palette() {
+    for (int i=0;i<PALETTE_COUNT;i++){
+        SDL_Color c = palette[i];
+        palette_argb[i] = ((uint32_t)c.a<<24) | ((uint32_t)c.r<<16) | ((uint32_t)c.g<<8) | c.b;
+    }
+}
+
+/* A friendly palette (index 0 is transparent/erase/background) */
+static const SDL_Color default_palette[PALETTE_COUNT] = {
+    {255,255,255,255}, /* 0 - white (background) */
+    {0,0,0,255},       /* 1 - black */
+    {255,0,0,255},     /* 2 - red */
+    {0,255,0,255},     /* 3 - lime */
+    {0,0,255,255},     /* 4 - blue */
+    {255,255,0,255},   /* 5 - yellow */
+    {255,165,0,255},   /* 6 - orange */
+    {128,0,128,255},   /* 7 - purple */
+    {0,255,255,255},   /* 8 - cyan */
+    {255,192,203,255}, /* 9 - pink */
+    {128,128,128,255}, /* 10 - gray */
+    {139,69,19,255}    /* 11 - brown */
+};
+
 static void init_default_palette() {
-    /* A friendly palette (index 0 is transparent/erase/background) */
-    SDL_Color p[PALETTE_COUNT] = {
-        {255,255,255,255}, /* 0 - white (background) */
-        {0,0,0,255},       /* 1 - black */
-        {255,0,0,255},     /* 2 - red */
-        {0,255,0,255},     /* 3 - lime */
-        {0,0,255,255},     /* 4 - blue */
-        {255,255,0,255},   /* 5 - yellow */
-        {255,165,0,255},   /* 6 - orange */
-        {128,0,128,255},   /* 7 - purple */
-        {0,255,255,255},   /* 8 - cyan */
-        {255,192,203,255}, /* 9 - pink */
-        {128,128,128,255}, /* 10 - gray */
-        {139,69,19,255}    /* 11 - brown */
-    };
-    for (int i=0;i<PALETTE_COUNT;i++) palette[i] = p[i];
+    memcpy(palette, default_palette, sizeof(palette));
+    pack_palette();
+}
+
+static long long box_area(Box b) {
+    return (long long)(b.x1 - b.x0 + 1) * (b.y1 - b.y0 + 1);
+}
+
+static Box box_union(Box a, Box b) {
+    Box u = { a.x0 < b.x0 ? a.x0 : b.x0, a.y0 < b.y0 ? a.y0 : b.y0,
+              a.x1 > b.x1 ? a.x1 : b.x1, a.y1 > b.y1 ? a.y1 : b.y1 };
+    return u;
+}
+
+/* Add a cell rectangle to the dirty set. A box is merged into an existing one
+   whenever the union is no larger than the two areas together; when the set
+   is full it joins the box whose union grows least. */
+static void mark_dirty(int x0, int y0, int x1, int y1) {
+    Box b = { x0, y0, x1, y1 };
+    for (int i=0;i<dirty_count;){
+        Box u = box_union(b, dirty[i]);
+        if (box_area(u) <= box_area(b) + box_area(dirty[i])) {
+            b = u;
+            dirty[i] = dirty[--dirty_count];
+            i = 0; /* the grown box may now absorb others */
+        } else i++;
+    }
+    if (dirty_count == DIRTY_MAX) {
+        int best = 0;
+        long long best_growth = LLONG_MAX;
+        for (int i=0;i<dirty_count;i++){
+            long long g = box_area(box_union(b, dirty[i])) - box_area(dirty[i]);
+            if (g < best_growth) { best_growth = g; best = i; }
+        }
+        b = box_union(b, dirty[best]);
+        dirty[best] = dirty[--dirty_count];
+    }
+    dirty[dirty_count++] = b;
+}
+
+static void mark_all_dirty() {
+    mark_dirty(0, 0, CELLS_X-1, CELLS_Y-1);
+}
+
+/* Undo tiles */
+static int tiles_x() { return (CELLS_X + TILE_SIZE - 1) / TILE_SIZE; }
+static int tiles_y() { return (CELLS_Y + TILE_SIZE - 1) / TILE_SIZE; }
+
+static void tile_rect(int t, int *x, int *y, int *w, int *h) {
+    *x = (t % tiles_x()) * TILE_SIZE;
+    *y = (t / tiles_x()) * TILE_SIZE;
+    *w = CELLS_X - *x < TILE_SIZE ? CELLS_X - *x : TILE_SIZE;
+    *h = CELLS_Y - *y < TILE_SIZE ? CELLS_Y - *y : TILE_SIZE;
+}
+
+static void tile_save(int t, uint8_t *dst) {
+    int x, y, w, h;
+    tile_rect(t, &x, &y, &w, &h);
+    for (int r=0;r<h;r++) memcpy(dst + r*TILE_SIZE, canvas + (size_t)(y+r)*CELLS_X + x, w);
+}
+
+/* Write snapshot s of rec back to its tile */
+static void tile_restore(const UndoRecord *rec, int s) {
+    int x, y, w, h;
+    tile_rect(rec->tiles[s % rec->ntiles], &x, &y, &w, &h);
+    const uint8_t *src = rec->data + rec->snap[s];
+    uint8_t *dst = canvas + (size_t)y*CELLS_X + x;
+    if (rec->snap[s+1] - rec->snap[s] == TILE_BYTES)
+        for (int r=0;r<h;r++) memcpy(dst + (size_t)r*CELLS_X, src + r*TILE_SIZE, w);
+    else rle_decode_rows(src, dst, CELLS_X, 0, h);
+    mark_dirty(x, y, x+w-1, y+h-1);
+}
+
+static void free_record(UndoRecord *rec) {
+    arena_release(doc_arena(), rec->tiles); /* snap and data share its allocation */
+    memset(rec, 0, sizeof(*rec));
+}
+
+static void history_clear() {
+    for (int i=0;i<history_count;i++) free_record(&history[i]);
+    history_count = history_pos = 0;
+}
+
+/* Edit journal (--journal file): an append-only log of everything that
+   changes the visible canvas, replayed by the timelapse exporter. Every undo
+   step, undo and redo appends the tiles it left behind, in the raw or RLE
+   snapshot form of the undo records. A new document, canvas size or palette
+   appends the whole canvas once, before the next tiles. Each record is
+   flushed, so after a crash the log is complete up to the last operation. */
+#define JOURNAL_MAGIC 0x314a5850u /* "PXJ1" */
+enum { JOURNAL_CANVAS = 1, JOURNAL_TILES = 2 };
+static FILE *journal = NULL;
+static int journal_canvas_pending = 0;
+
+/* A short write leaves a record the replay cannot step over: stop recording */
+static void journal_check(int ok) {
+    if (fflush(journal) != 0) ok = 0;
+    if (ok) return;
+    fprintf(stderr, "Cannot write the journal; recording stopped\n");
+    fclose(journal);
+    journal = NULL;
+}
+
+/* uint32 type, w, h; the palette; uint64 length; the cells as an RLE blob
+   when that is shorter than w*h, raw otherwise */
+static void journal_canvas() {
+    journal_canvas_pending = 0;
+    if (!journal) return;
+    size_t n = cell_count();
+    size_t size = rle_size(canvas, CELLS_X, CELLS_Y, CELLS_X, n - 1);
+    uint8_t *blob = size ? (uint8_t*)malloc(size) : NULL;
+    if (blob) rle_encode(blob, canvas, CELLS_X, CELLS_Y, CELLS_X);
+    uint32_t hdr[3] = { JOURNAL_CANVAS, (uint32_t)CELLS_X, (uint32_t)CELLS_Y };
+    uint64_t len = blob ? size : n;
+    int ok = fwrite(hdr, sizeof(hdr), 1, journal) == 1 && fwrite(palette, sizeof(palette), 1, journal) == 1 &&
+             fwrite(&len, sizeof(len), 1, journal) == 1 && fwrite(blob ? blob : canvas, 1, (size_t)len, journal) == len;
+    free(blob);
+    journal_check(ok);
+}
+
+/* uint32 type, ntiles; per tile uint32 index, length and the snapshot.
+   Snapshots first..first+ntiles-1 of rec are the tiles as they are now. */
+static void journal_tiles(const UndoRecord *rec, int first) {
+    if (!journal) return;
+    if (journal_canvas_pending) journal_canvas();
+    if (!journal) return;
+    uint32_t hdr[2] = { JOURNAL_TILES, (uint32_t)rec->ntiles };
+    int ok = fwrite(hdr, sizeof(hdr), 1, journal) == 1;
+    for (int i=0;i<rec->ntiles && ok;i++){
+        int s = first + i;
+        uint32_t t[2] = { (uint32_t)rec->tiles[i], (uint32_t)(rec->snap[s+1] - rec->snap[s]) };
+        ok = fwrite(t, sizeof(t), 1, journal) == 1 && fwrite(rec->data + rec->snap[s], 1, t[1], journal) == t[1];
+    }
+    journal_check(ok);
+}
+
+static int journal_open(const char *path) {
+    journal = fopen(path, "ab");
+    if (!journal) return -1;
+    fseek(journal, 0, SEEK_END);
+    if (ftell(journal) == 0) {
+        uint32_t hdr[2] = { JOURNAL_MAGIC, TILE_SIZE };
+        if (fwrite(hdr, sizeof(hdr), 1, journal) != 1) { fclose(journal); journal = NULL; return -1; }
+    }
+    journal_canvas_pending = 1; /* a session starts from the canvas it opens with */
+    return 0;
+}
+
+/* Needs the active canvas: call before the documents are freed */
+static void journal_close() {
+    if (!journal) return;
+    if (journal_canvas_pending) journal_canvas();
+    if (journal && fclose(journal) != 0) fprintf(stderr, "Cannot write the journal\n");
+    journal = NULL;
+}
+
+/* Start recording an edit; every write between edit_begin and edit_end
+   becomes a single undo step */
+static void edit_fail() {
+    if (!edit_failed) fprintf(stderr, "Out of memory recording undo step; the rest of this edit is dropped\n");
+    edit_failed = 1;
+}
+
+static void edit_begin() {
+    int n = tiles_x() * tiles_y();
+    edit_ntiles = 0;
+    edit_active = 1;
+    edit_failed = 0;
+    if (n != edit_seen_count) {
+        uint8_t *seen = (uint8_t*)arena_alloc(doc_arena(), n);
+        if (!seen) { edit_fail(); return; }
+        arena_release(doc_arena(), edit_seen);
+        edit_seen = seen;
+        edit_seen_count = n;
+    }
+    memset(edit_seen, 0, n);
+}
+
+/* Save the tiles under a cell rectangle (inclusive, clipped) before they are
+   written; -1 when they cannot be, and the caller must not write them */
+static int edit_touch(int x0, int y0, int x1, int y1) {
+    if (!edit_active) return 0;
+    if (edit_failed) return -1;
+    for (int ty=y0/TILE_SIZE; ty<=y1/TILE_SIZE; ty++){
+        for (int tx=x0/TILE_SIZE; tx<=x1/TILE_SIZE; tx++){
+            int t = ty*tiles_x() + tx;
+            if (edit_seen[t]) continue;
+            if (edit_ntiles == edit_cap) {
+                int ncap = edit_cap ? edit_cap*2 : 16;
+                int *nt = (int*)realloc(edit_tiles, sizeof(int) * ncap);
+                if (nt) edit_tiles = nt;
+                uint8_t *nb = nt ? (uint8_t*)realloc(edit_before, (size_t)ncap * TILE_BYTES) : NULL;
+                if (!nb) { edit_fail(); return -1; }
+                edit_before = nb;
+                edit_cap = ncap;
+            }
+            edit_seen[t] = 1;
+            edit_tiles[edit_ntiles] = t;
+            tile_save(t, edit_before + (size_t)edit_ntiles * TILE_BYTES);
+            edit_ntiles++;
+        }
+    }
+    return 0;
+}
+
+static void edit_end() {
+    if (!edit_active) return;
+    edit_active = 0;
+    if (edit_ntiles == 0) return;
+    int n = edit_ntiles;
+    if (edit_after_cap < edit_cap) {
+        uint8_t *na = (uint8_t*)realloc(edit_after, (size_t)edit_cap * TILE_BYTES);
+        size_t *ns = na ? (size_t*)realloc(edit_snap, sizeof(size_t) * (2 * (size_t)edit_cap + 1)) : NULL;
+        if (na) edit_after = na;
+        if (ns) { edit_snap = ns; edit_after_cap = edit_cap; }
+        else {
+            fprintf(stderr, "Out of memory recording undo step\n");
+            return;
+        }
+    }
+    /* size every snapshot: an RLE blob if it comes out shorter than the raw
+       tile (rounded to 4 so blobs stay aligned), raw otherwise */
+    size_t total = 0;
+    for (int s=0;s<2*n;s++){
+        int x, y, w, h;
+        tile_rect(edit_tiles[s % n], &x, &y, &w, &h);
+        uint8_t *src = (s < n ? edit_before : edit_after) + (size_t)(s % n) * TILE_BYTES;
+        if (s >= n) tile_save(edit_tiles[s - n], src);
+        size_t size = rle_size(src, w, h, TILE_SIZE, TILE_BYTES - 4);
+        edit_snap[s] = total;
+        total += size ? (size + 3) & ~(size_t)3 : TILE_BYTES;
+    }
+    edit_snap[2*n] = total;
+    size_t head = ARENA_ROUND(sizeof(int) * n) + ARENA_ROUND(sizeof(size_t) * (2 * (size_t)n + 1));
+    UndoRecord rec;
+    rec.ntiles = n;
+    rec.tiles = (int*)arena_alloc(doc_arena(), head + total);
+    if (!rec.tiles) {
+        fprintf(stderr, "Out of memory recording undo step\n");
+        return;
+    }
+    rec.snap = (size_t*)((uint8_t*)rec.tiles + ARENA_ROUND(sizeof(int) * n));
+    rec.data = (uint8_t*)rec.tiles + head;
+    memcpy(rec.tiles, edit_tiles, sizeof(int) * n);
+    memcpy(rec.snap, edit_snap, sizeof(size_t) * (2 * (size_t)n + 1));
+    for (int s=0;s<2*n;s++){
+        int x, y, w, h;
+        tile_rect(rec.tiles[s % n], &x, &y, &w, &h);
+        const uint8_t *src = (s < n ? edit_before : edit_after) + (size_t)(s % n) * TILE_BYTES;
+        if (rec.snap[s+1] - rec.snap[s] == TILE_BYTES) memcpy(rec.data + rec.snap[s], src, TILE_BYTES);
+        else rle_encode(rec.data + rec.snap[s], src, w, h, TILE_SIZE);
+    }
+
+    /* a new edit drops the redo tail; a full history drops the oldest step */
+    for (int i=history_pos;i<history_count;i++) free_record(&history[i]);
+    history_count = history_pos;
+    if (history_count == HISTORY_MAX) {
+        free_record(&history[0]);
+        memmove(history, history+1, sizeof(UndoRecord) * (HISTORY_MAX-1));
+        history_count--;
+    }
+    history[history_count++] = rec;
+    history_pos = history_count;
+    journal_tiles(&history[history_count - 1], n);
+}
+
+static void undo() {
+    if (history_pos == 0) return;
+    UndoRecord *rec = &history[--history_pos];
+    for (int i=0;i<rec->ntiles;i++) tile_restore(rec, i);
+    journal_tiles(rec, 0);
+}
+
+static void redo() {
+    if (history_pos == history_count) return;
+    UndoRecord *rec = &history[history_pos++];
+    for (int i=0;i<rec->ntiles;i++) tile_restore(rec, rec->ntiles + i);
+    journal_tiles(rec, rec->ntiles);
 }
 
 static void clear_canvas() {
     ensure_canvas_allocated();
-    memset(canvas, 0, CELLS_X * CELLS_Y);
+    if (edit_touch(0, 0, CELLS_X-1, CELLS_Y-1) != 0) return;
+    memset(canvas, 0, cell_count());
+    mark_all_dirty();
 }
 
-static void draw_canvas_to_renderer(SDL_Renderer *ren) {
-    ensure_canvas_allocated();
-    for (int y=0;y<CELLS_Y;y++){
-        for (int x=0;x<CELLS_X;x++){
-            int idx = y*CELLS_X + x;
-            uint8_t cidx = canvas[idx];
-            SDL_Color col = palette[cidx];
-            SDL_Rect r = { x*CELL_SIZE, y*CELL_SIZE, CELL_SIZE, CELL_SIZE };
-            SDL_SetRenderDrawColor(ren, col.r, col.g, col.b, col.a);
-            SDL_RenderFillRect(ren, &r);
-            if (show_grid) {
-                SDL_SetRenderDrawColor(ren, 200, 200, 200, 255);
-                SDL_RenderDrawRect(ren, &r);
+/* Rasterize the current brush shape into brush_stamp. Every row contains the
+   center column, so stamps moved by one cell always overlap on each row. */
+static void rebuild_brush_stamp() {
+    int r = brush_radius;
+    brush_stamp_rows = 0;
+    for (int dy=-r; dy<=r; dy++){
+        int half = r;
+        if (brush_shape == BRUSH_ROUND) half = (int)sqrt((double)(r*r + r - dy*dy));
+        StampSpan s = { dy, -half, half };
+        brush_stamp[brush_stamp_rows++] = s;
+    }
+}
+
+/* The only place cells are painted: clips and records undo. Callers mark the
+   texture dirty for the whole batch. */
+static void fill_row_span(int y, int x0, int x1, uint8_t color) {
+    if (y < 0 || y >= CELLS_Y) return;
+    if (x0 < 0) x0 = 0;
+    if (x1 >= CELLS_X) x1 = CELLS_X-1;
+    if (x0 > x1 || edit_touch(x0, y, x1, y) != 0) return;
+    memset(canvas + (size_t)y*CELLS_X + x0, color, x1 - x0 + 1);
+}
+
+static void span_push(int y, int x0, int x1) {
+    if (span_count == span_cap) {
+        int ncap = span_cap ? span_cap*2 : 256;
+        Span *ns = (Span*)realloc(spans, sizeof(Span) * ncap);
+        if (!ns) return;
+        spans = ns;
+        span_cap = ncap;
+    }
+    Span s = { y, x0, x1 };
+    spans[span_count++] = s;
+}
+
+static int span_cmp(const void *a, const void *b) {
+    const Span *p = (const Span*)a, *q = (const Span*)b;
+    if (p->y != q->y) return p->y < q->y ? -1 : 1;
+    return (p->x0 > q->x0) - (p->x0 < q->x0);
+}
+
+static int wrap_coord(int v, int n) {
+    v %= n;
+    return v < 0 ? v + n : v;
+}
+
+/* Wrap the range a0..a1 into 0..n-1; returns the number of pieces (1 or 2) */
+static int wrap_range(int a0, int a1, int n, int out[2][2]) {
+    if (a1 - a0 + 1 >= n) { out[0][0] = 0; out[0][1] = n-1; return 1; }
+    int a = wrap_coord(a0, n), b = a + (a1 - a0);
+    out[0][0] = a;
+    if (b < n) { out[0][1] = b; return 1; }
+    out[0][1] = n-1;
+    out[1][0] = 0; out[1][1] = b - n;
+    return 2;
+}
+
+/* Split a box into the (up to 4) pieces it covers once wrapped into the canvas */
+static int wrap_box(Box b, Box out[4]) {
+    int xr[2][2], yr[2][2], n = 0;
+    int nx = wrap_range(b.x0, b.x1, CELLS_X, xr), ny = wrap_range(b.y0, b.y1, CELLS_Y, yr);
+    for (int j=0;j<ny;j++) for (int i=0;i<nx;i++){
+        Box p = { xr[i][0], yr[j][0], xr[i][1], yr[j][1] };
+        out[n++] = p;
+    }
+    return n;
+}
+
+/* Mirror the freshly rasterized span list for the active symmetry mode, all
+   in one batch: copies are appended, then the list is sorted and overlapping
+   spans merged so cells shared by several copies are written once. In tile
+   mode the spans are wrapped into the canvas first. Also records one bounding
+   box per copy (and wrapped piece) for dirty tracking. */
+static void finish_spans() {
+    span_box_count = 0;
+    if (span_count == 0) return;
+    Box b = { INT_MAX, INT_MAX, INT_MIN, INT_MIN };
+    for (int i=0;i<span_count;i++){
+        if (spans[i].x0 < b.x0) b.x0 = spans[i].x0;
+        if (spans[i].x1 > b.x1) b.x1 = spans[i].x1;
+        if (spans[i].y < b.y0) b.y0 = spans[i].y;
+        if (spans[i].y > b.y1) b.y1 = spans[i].y;
+    }
+    span_boxes[span_box_count++] = b;
+    if (symmetry == SYM_NONE && !tile_mode) return;
+
+    int n = span_count;
+    int mx = CELLS_X - 1, my = CELLS_Y - 1;
+    if (symmetry == SYM_H || symmetry == SYM_4) {
+        for (int i=0;i<n;i++) span_push(spans[i].y, mx - spans[i].x1, mx - spans[i].x0);
+        Box m = { mx - b.x1, b.y0, mx - b.x0, b.y1 };
+        span_boxes[span_box_count++] = m;
+    }
+    if (symmetry == SYM_V || symmetry == SYM_4) {
+        int m0 = span_count;
+        for (int i=0;i<m0;i++) span_push(my - spans[i].y, spans[i].x0, spans[i].x1);
+        for (int i=0, nb=span_box_count; i<nb; i++){
+            Box m = { span_boxes[i].x0, my - span_boxes[i].y1, span_boxes[i].x1, my - span_boxes[i].y0 };
+            span_boxes[span_box_count++] = m;
+        }
+    }
+    if (tile_mode) {
+        int n0 = span_count;
+        for (int i=0;i<n0;i++){
+            int xr[2][2];
+            int k = wrap_range(spans[i].x0, spans[i].x1, CELLS_X, xr);
+            int y = wrap_coord(spans[i].y, CELLS_Y);
+            for (int j=0;j<k;j++) span_push(y, xr[j][0], xr[j][1]);
+        }
+        memmove(spans, spans + n0, sizeof(Span) * (span_count - n0));
+        span_count -= n0;
+        Box copies[4];
+        int nb = span_box_count;
+        memcpy(copies, span_boxes, sizeof(Box) * nb);
+        span_box_count = 0;
+        for (int i=0;i<nb;i++) span_box_count += wrap_box(copies[i], span_boxes + span_box_count);
+    }
+
+    qsort(spans, span_count, sizeof(Span), span_cmp);
+    int w = 0;
+    for (int i=0;i<span_count;i++){
+        if (w > 0 && spans[w-1].y == spans[i].y && spans[i].x0 <= spans[w-1].x1 + 1) {
+            if (spans[i].x1 > spans[w-1].x1) spans[w-1].x1 = spans[i].x1;
+        } else spans[w++] = spans[i];
+    }
+    span_count = w;
+}
+
+static void apply_spans(uint8_t color) {
+    for (int i=0;i<span_count;i++) fill_row_span(spans[i].y, spans[i].x0, spans[i].x1, color);
+    for (int i=0;i<span_box_count;i++){
+        Box b = span_boxes[i];
+        if (b.x0 < 0) b.x0 = 0;
+        if (b.y0 < 0) b.y0 = 0;
+        if (b.x1 >= CELLS_X) b.x1 = CELLS_X-1;
+        if (b.y1 >= CELLS_Y) b.y1 = CELLS_Y-1;
+        if (b.x0 <= b.x1 && b.y0 <= b.y1) mark_dirty(b.x0, b.y0, b.x1, b.y1);
+    }
+}
+
+/* Start gathering one [min,max] interval per row for rows ybase..ybase+rows-1 */
+static int rows_reset(int ybase, int rows) {
+    if (rows > row_cap) {
+        int *nmin = (int*)realloc(row_min, sizeof(int) * rows);
+        if (!nmin) return -1;
+        row_min = nmin;
+        int *nmax = (int*)realloc(row_max, sizeof(int) * rows);
+        if (!nmax) return -1;
+        row_max = nmax;
+        row_cap = rows;
+    }
+    for (int i=0;i<rows;i++){ row_min[i] = INT_MAX; row_max[i] = INT_MIN; }
+    row_base = ybase;
+    row_count = rows;
+    return 0;
+}
+
+/* Turn the gathered rows into spans. With outline set only the boundary of
+   the (row-convex) shape is kept: the cells of each row that the rows above
+   or below do not cover, plus both row ends. */
+static void rows_emit(int outline) {
+    for (int i=0;i<row_count;i++){
+        int l = row_min[i], r = row_max[i];
+        if (l > r) continue;
+        if (!outline) { span_push(row_base + i, l, r); continue; }
+        int nl = INT_MIN, nr = INT_MAX; /* innermost neighbour extent */
+        for (int j=i-1;j<=i+1;j+=2){
+            int ol = (j >= 0 && j < row_count) ? row_min[j] : INT_MAX;
+            int or = (j >= 0 && j < row_count) ? row_max[j] : INT_MIN;
+            if (ol > or) { ol = INT_MAX; or = INT_MIN; }
+            if (ol > nl) nl = ol;
+            if (or < nr) nr = or;
+        }
+        int le = (nl == INT_MAX) ? r : (nl - 1 > l ? nl - 1 : l);
+        int rs = (nr == INT_MIN) ? l : (nr + 1 < r ? nr + 1 : r);
+        if (le + 1 >= rs) span_push(row_base + i, l, r);
+        else { span_push(row_base + i, l, le); span_push(row_base + i, rs, r); }
+    }
+}
+
+/* Stamp the brush along the line (x0,y0)-(x1,y1). The swept area is gathered
+   as one [min,max] interval per row first, so each cell is written once no
+   matter how many stamps overlap it. */
+static void stroke_segment_spans(int x0, int y0, int x1, int y1) {
+    int r = brush_radius;
+    if (rows_reset((y0 < y1 ? y0 : y1) - r, abs(y1 - y0) + 2*r + 1) != 0) return;
+
+    /* Bresenham walk over the stamp centers */
+    int dx = abs(x1 - x0), sx = x0 < x1 ? 1 : -1;
+    int dy = -abs(y1 - y0), sy = y0 < y1 ? 1 : -1;
+    int err = dx + dy;
+    int px = x0, py = y0;
+    for (;;) {
+        for (int i=0;i<brush_stamp_rows;i++){
+            const StampSpan *s = &brush_stamp[i];
+            int row = py + s->dy - row_base;
+            if (px + s->x0 < row_min[row]) row_min[row] = px + s->x0;
+            if (px + s->x1 > row_max[row]) row_max[row] = px + s->x1;
+        }
+        if (px == x1 && py == y1) break;
+        int e2 = 2*err;
+        if (e2 >= dy) { err += dy; px += sx; }
+        if (e2 <= dx) { err += dx; py += sy; }
+    }
+    rows_emit(0);
+}
+
+/* Copy the custom brush centered on (cx,cy); erasing clears its opaque cells instead */
+static void stamp_custom_brush(int cx, int cy, int erase) {
+    int ox = cx - custom_brush.w/2, oy = cy - custom_brush.h/2;
+    for (int i=0;i<custom_brush.nruns;i++){
+        const BrushRun *r = &custom_brush.runs[i];
+        int y = oy + r->dy;
+        if (tile_mode) {
+            int xr[2][2];
+            int k = wrap_range(ox + r->dx, ox + r->dx + r->len - 1, CELLS_X, xr);
+            int off = r->off;
+            y = wrap_coord(y, CELLS_Y);
+            for (int j=0;j<k;j++){
+                int len = xr[j][1] - xr[j][0] + 1;
+                if (edit_touch(xr[j][0], y, xr[j][1], y) != 0) return;
+                if (erase) memset(canvas + (size_t)y*CELLS_X + xr[j][0], 0, len);
+                else memcpy(canvas + (size_t)y*CELLS_X + xr[j][0], custom_brush.pixels + off, len);
+                off += len;
             }
+            continue;
         }
+        if (y < 0 || y >= CELLS_Y) continue;
+        int x0 = ox + r->dx, x1 = x0 + r->len - 1, off = r->off;
+        if (x0 < 0) { off -= x0; x0 = 0; }
+        if (x1 >= CELLS_X) x1 = CELLS_X-1;
+        if (x0 > x1) continue;
+        if (edit_touch(x0, y, x1, y) != 0) return;
+        if (erase) memset(canvas + (size_t)y*CELLS_X + x0, 0, x1 - x0 + 1);
+        else memcpy(canvas + (size_t)y*CELLS_X + x0, custom_brush.pixels + off, x1 - x0 + 1);
     }
 }
 
-static void draw_palette_ui(SDL_Renderer *ren, int win_w, int win_h) {
-    int pal_x = CELLS_X * CELL_SIZE + 10;
-    int pal_y = 10;
-    int box = 24;
-    for (int i=0;i<PALETTE_COUNT;i++){
-        SDL_Rect r = { pal_x + (i%2)*(box+8), pal_y + (i/2)*(box+8), box, box };
-        SDL_Color c = palette[i];
-        SDL_SetRenderDrawColor(ren, c.r, c.g, c.b, c.a);
-        SDL_RenderFillRect(ren, &r);
-        SDL_SetRenderDrawColor(ren, 0,0,0,255);
-        SDL_RenderDrawRect(ren, &r);
-        if (i == current_color) {
-            SDL_Rect out = { r.x-2, r.y-2, r.w+4, r.h+4 };
-            SDL_SetRenderDrawColor(ren, 0,0,0,255);
-            SDL_RenderDrawRect(ren, &out);
+/* Stamp the custom brush at every cell of the line. Symmetry does not apply
+   to custom brushes, which are stamped as captured. */
+static void custom_brush_segment(int x0, int y0, int x1, int y1, int erase) {
+    int dx = abs(x1 - x0), sx = x0 < x1 ? 1 : -1;
+    int dy = -abs(y1 - y0), sy = y0 < y1 ? 1 : -1;
+    int err = dx + dy;
+    int px = x0, py = y0;
+    for (;;) {
+        stamp_custom_brush(px, py, erase);
+        if (px == x1 && py == y1) break;
+        int e2 = 2*err;
+        if (e2 >= dy) { err += dy; px += sx; }
+        if (e2 <= dx) { err += dx; py += sy; }
+    }
+    int bx0 = (x0 < x1 ? x0 : x1) - custom_brush.w/2, by0 = (y0 < y1 ? y0 : y1) - custom_brush.h/2;
+    int bx1 = (x0 > x1 ? x0 : x1) - custom_brush.w/2 + custom_brush.w - 1;
+    int by1 = (y0 > y1 ? y0 : y1) - custom_brush.h/2 + custom_brush.h - 1;
+    if (tile_mode) {
+        Box b = { bx0, by0, bx1, by1 }, pieces[4];
+        int n = wrap_box(b, pieces);
+        for (int i=0;i<n;i++) mark_dirty(pieces[i].x0, pieces[i].y0, pieces[i].x1, pieces[i].y1);
+        return;
+    }
+    if (bx0 < 0) bx0 = 0;
+    if (by0 < 0) by0 = 0;
+    if (bx1 >= CELLS_X) bx1 = CELLS_X-1;
+    if (by1 >= CELLS_Y) by1 = CELLS_Y-1;
+    if (bx0 <= bx1 && by0 <= by1) mark_dirty(bx0, by0, bx1, by1);
+}
+
+/* Build the custom brush from the selected region of the canvas */
+static int capture_custom_brush() {
+    if (!sel_active) return -1;
+    int w = sel_x1 - sel_x0 + 1, h = sel_y1 - sel_y0 + 1;
+    uint8_t *pixels = (uint8_t*)malloc((size_t)w * h);
+    BrushRun *runs = (BrushRun*)malloc(sizeof(BrushRun) * ((w + 1) / 2) * h); /* worst case: alternating cells */
+    if (!pixels || !runs) { free(pixels); free(runs); return -1; }
+    int nruns = 0;
+    for (int y=0;y<h;y++){
+        const uint8_t *src = canvas + (size_t)(sel_y0 + y)*CELLS_X + sel_x0;
+        memcpy(pixels + (size_t)y*w, src, w);
+        for (int x=0;x<w;){
+            if (!src[x]) { x++; continue; }
+            int start = x;
+            while (x < w && src[x]) x++;
+            BrushRun r = { y, start, x - start, (size_t)y*w + start };
+            runs[nruns++] = r;
+        }
+    }
+    free(custom_brush.pixels);
+    free(custom_brush.runs);
+    custom_brush.w = w; custom_brush.h = h;
+    custom_brush.pixels = pixels;
+    custom_brush.runs = runs;
+    custom_brush.nruns = nruns;
+    return 0;
+}
+
+static void fill_push(int x, int y) {
+    if (fill_stack_len + 2 > fill_stack_cap) {
+        int ncap = fill_stack_cap ? fill_stack_cap*2 : 1024;
+        int *ns = (int*)realloc(fill_stack, sizeof(int) * ncap);
+        if (!ns) return;
+        fill_stack = ns;
+        fill_stack_cap = ncap;
+    }
+    fill_stack[fill_stack_len++] = x;
+    fill_stack[fill_stack_len++] = y;
+}
+
+/* Scanline flood fill: collect the 4-connected region of the seed's color as
+   row spans without writing, so the spans can then be painted with any pattern */
+static int flood_fill_spans(int sx, int sy) {
+    span_count = 0;
+    if (sx < 0 || sx >= CELLS_X || sy < 0 || sy >= CELLS_Y) return -1;
+    if (fill_seen_size != cell_count()) {
+        /* calloc rather than realloc + memset: large blocks come zeroed from
+           the OS, so only the rows a fill actually visits become resident */
+        free(fill_seen);
+        fill_seen = (uint8_t*)calloc(cell_count(), 1);
+        fill_seen_size = fill_seen ? cell_count() : 0;
+        if (!fill_seen) return -1;
+    }
+    uint8_t target = canvas[(size_t)sy*CELLS_X + sx];
+    fill_stack_len = 0;
+    fill_push(sx, sy);
+    while (fill_stack_len > 0) {
+        int y = fill_stack[--fill_stack_len];
+        int x = fill_stack[--fill_stack_len];
+        const uint8_t *row = canvas + (size_t)y*CELLS_X;
+        uint8_t *seen = fill_seen + (size_t)y*CELLS_X;
+        if (seen[x] || row[x] != target) continue;
+        int x0 = x, x1 = x;
+        while (x0 > 0 && row[x0-1] == target && !seen[x0-1]) x0--;
+        while (x1 < CELLS_X-1 && row[x1+1] == target && !seen[x1+1]) x1++;
+        memset(seen + x0, 1, x1 - x0 + 1);
+        span_push(y, x0, x1);
+        /* one seed per run of fillable cells in the rows above and below */
+        for (int ny=y-1; ny<=y+1; ny+=2){
+            if (ny < 0 || ny >= CELLS_Y) continue;
+            const uint8_t *nrow = canvas + (size_t)ny*CELLS_X;
+            const uint8_t *nseen = fill_seen + (size_t)ny*CELLS_X;
+            for (int nx=x0; nx<=x1; nx++){
+                if (nrow[nx] != target || nseen[nx]) continue;
+                fill_push(nx, ny);
+                while (nx < x1 && nrow[nx+1] == target && !nseen[nx+1]) nx++;
+            }
+        }
+    }
+    /* reset only what was marked, so a small fill stays cheap on a big canvas */
+    for (int i=0;i<span_count;i++) memset(fill_seen + (size_t)spans[i].y*CELLS_X + spans[i].x0, 0, spans[i].x1 - spans[i].x0 + 1);
+    return 0;
+}
+
+/* Expand the active fill pattern into pattern_rows */
+static int build_fill_pattern() {
+    static const uint8_t bayer4[4][4] = {
+        { 0, 8, 2,10},
+        {12, 4,14, 6},
+        { 3,11, 1, 9},
+        {15, 7,13, 5}
+    };
+    int pw = 1, ph = 1;
+    if (fill_mode == FILL_DITHER) { pw = 4; ph = 4; }
+    else if (fill_mode == FILL_PATTERN && custom_brush.pixels) { pw = custom_brush.w; ph = custom_brush.h; }
+    int stride = CELLS_X + pw;
+    uint8_t *rows = (uint8_t*)realloc(pattern_rows, (size_t)stride * ph);
+    if (!rows) return -1;
+    pattern_rows = rows;
+    pattern_w = pw; pattern_h = ph; pattern_stride = stride;
+    for (int y=0;y<ph;y++){
+        uint8_t *dst = pattern_rows + (size_t)y * stride;
+        for (int x=0;x<pw;x++){
+            if (fill_mode == FILL_DITHER) dst[x] = bayer4[y][x] < dither_level ? (uint8_t)secondary_color : (uint8_t)current_color;
+            else if (fill_mode == FILL_PATTERN && custom_brush.pixels) dst[x] = custom_brush.pixels[y*pw + x];
+            else dst[x] = (uint8_t)current_color;
+        }
+        for (int x=pw;x<stride;x++) dst[x] = dst[x - pw];
+    }
+    return 0;
+}
+
+/* Fill the region under (cx,cy). Patterns are anchored to the canvas origin,
+   so adjacent fills line up. Erasing always fills solid index 0. */
+static void fill_at(int cx, int cy, int erase) {
+    if (flood_fill_spans(cx, cy) != 0 || span_count == 0) return;
+    if (!erase && build_fill_pattern() != 0) return;
+    Box b = { INT_MAX, INT_MAX, INT_MIN, INT_MIN };
+    for (int i=0;i<span_count;i++){
+        int y = spans[i].y, x0 = spans[i].x0, x1 = spans[i].x1;
+        if (edit_touch(x0, y, x1, y) != 0) break;
+        if (erase) memset(canvas + (size_t)y*CELLS_X + x0, 0, x1 - x0 + 1);
+        else memcpy(canvas + (size_t)y*CELLS_X + x0, pattern_rows + (size_t)(y % pattern_h) * pattern_stride + x0 % pattern_w, x1 - x0 + 1);
+        if (x0 < b.x0) b.x0 = x0;
+        if (x1 > b.x1) b.x1 = x1;
+        if (y < b.y0) b.y0 = y;
+        if (y > b.y1) b.y1 = y;
+    }
+    mark_dirty(b.x0, b.y0, b.x1, b.y1);
+}
+
+static void paint_stroke_segment(int x0, int y0, int x1, int y1, uint8_t color) {
+    if (use_custom_brush && custom_brush.nruns) {
+        custom_brush_segment(x0, y0, x1, y1, color == 0);
+        return;
+    }
+    span_count = 0;
+    stroke_segment_spans(x0, y0, x1, y1);
+    finish_spans();
+    apply_spans(color);
+}
+
+static void begin_stroke(int cx, int cy, uint8_t color) {
+    stroke_x = cx; stroke_y = cy; stroke_color = color;
+    paint_stroke_segment(cx, cy, cx, cy, color);
+}
+
+static void continue_stroke(int cx, int cy) {
+    if (cx == stroke_x && cy == stroke_y) return;
+    paint_stroke_segment(stroke_x, stroke_y, cx, cy, stroke_color);
+    stroke_x = cx; stroke_y = cy;
+}
+
+/* Rasterize the active shape tool into spans without touching the canvas.
+   Lines use the brush; rectangles and ellipses span the dragged bounding box. */
+static void shape_spans(int tool, int x0, int y0, int x1, int y1, int filled) {
+    shape_version++;
+    span_count = 0;
+    if (tool == TOOL_LINE) {
+        stroke_segment_spans(x0, y0, x1, y1);
+        finish_spans();
+        return;
+    }
+    if (x0 > x1) { int t = x0; x0 = x1; x1 = t; }
+    if (y0 > y1) { int t = y0; y0 = y1; y1 = t; }
+    if (rows_reset(y0, y1 - y0 + 1) != 0) return;
+    /* ellipse inscribed in the box: keep cells whose centers fall inside */
+    double xc = (x0 + x1 + 1) * 0.5, yc = (y0 + y1 + 1) * 0.5;
+    double a = (x1 - x0 + 1) * 0.5, b = (y1 - y0 + 1) * 0.5;
+    for (int i=0;i<row_count;i++){
+        int l = x0, r = x1;
+        if (tool == TOOL_ELLIPSE) {
+            double v = (y0 + i + 0.5 - yc) / b;
+            double hw = a * sqrt(1.0 - v*v);
+            l = (int)ceil(xc - hw - 0.5);
+            r = (int)floor(xc + hw - 0.5);
+            if (l > r) { l = (x0 + x1) / 2; r = (x0 + x1 + 1) / 2; }
         }
+        row_min[i] = l;
+        row_max[i] = r;
     }
+    rows_emit(!filled);
+    finish_spans();
+}
+
+/* Canvas transforms. Same-size transforms are recorded as one undo step;
+   transforms that change the dimensions replace the canvas in a single
+   allocation and start a fresh history, since undo tiles assume a fixed size. */
+#define TRANSPOSE_BLOCK 16
+
+static uint8_t *canvas_alloc(int w, int h) {
+    return (uint8_t*)arena_alloc(doc_arena(), (size_t)w * h);
+}
+
+/* Install a new canvas buffer of w x h cells from canvas_alloc, releasing the old one */
+static void replace_canvas(uint8_t *buf, int w, int h) {
+    if (w != CELLS_X || h != CELLS_Y) {
+        edit_active = 0;
+        history_clear();
+        journal_canvas_pending = 1; /* no undo step records this one */
+    }
+    arena_release(doc_arena(), canvas);
+    canvas = buf;
+    CELLS_X = w;
+    CELLS_Y = h;
+    sel_active = 0;
+    mark_all_dirty();
+}
+
+static int flip_horizontal() {
+    uint8_t *tmp = (uint8_t*)malloc(CELLS_X);
+    if (!tmp) return -1;
+    if (edit_touch(0, 0, CELLS_X-1, CELLS_Y-1) != 0) { free(tmp); return -1; }
+    for (int y=0;y<CELLS_Y;y++){
+        uint8_t *row = canvas + (size_t)y*CELLS_X;
+        int x = 0;
+        /* reverse 8 cells at a time with a byte swap */
+        for (; x + 8 <= CELLS_X; x += 8){
+            uint64_t v;
+            memcpy(&v, row + CELLS_X - 8 - x, 8);
+            v = SDL_Swap64(v);
+            memcpy(tmp + x, &v, 8);
+        }
+        for (; x<CELLS_X; x++) tmp[x] = row[CELLS_X-1-x];
+        memcpy(row, tmp, CELLS_X);
+    }
+    free(tmp);
+    mark_all_dirty();
+    return 0;
+}
+
+static int flip_vertical() {
+    uint8_t *tmp = (uint8_t*)malloc(CELLS_X);
+    if (!tmp) return -1;
+    if (edit_touch(0, 0, CELLS_X-1, CELLS_Y-1) != 0) { free(tmp); return -1; }
+    for (int y=0;y<CELLS_Y/2;y++){
+        uint8_t *a = canvas + (size_t)y*CELLS_X, *b = canvas + (size_t)(CELLS_Y-1-y)*CELLS_X;
+        memcpy(tmp, a, CELLS_X);
+        memcpy(a, b, CELLS_X);
+        memcpy(b, tmp, CELLS_X);
+    }
+    free(tmp);
+    mark_all_dirty();
+    return 0;
+}
+
+/* Rotate by 90 degrees (clockwise if cw) with a blocked transpose: within a
+   TRANSPOSE_BLOCK square each destination row is written sequentially while
+   the few source rows it reads from stay in cache. */
+static int rotate_90(int cw) {
+    int w = CELLS_X, h = CELLS_Y;
+    uint8_t *dst = canvas_alloc(w, h);
+    if (!dst) return -1;
+    for (int by=0; by<h; by+=TRANSPOSE_BLOCK){
+        int ey = by + TRANSPOSE_BLOCK < h ? by + TRANSPOSE_BLOCK : h;
+        for (int bx=0; bx<w; bx+=TRANSPOSE_BLOCK){
+            int ex = bx + TRANSPOSE_BLOCK < w ? bx + TRANSPOSE_BLOCK : w;
+            for (int x=bx; x<ex; x++){
+                const uint8_t *src = canvas + x;
+                if (cw) { uint8_t *d = dst + (size_t)x*h + h-1; for (int y=by; y<ey; y++) d[-y] = src[(size_t)y*w]; }
+                else { uint8_t *d = dst + (size_t)(w-1-x)*h; for (int y=by; y<ey; y++) d[y] = src[(size_t)y*w]; }
+            }
+        }
+    }
+    if (w == h && edit_touch(0, 0, w-1, h-1) != 0) { arena_release(doc_arena(), dst); return -1; }
+    replace_canvas(dst, h, w);
+    return 0;
+}
+
+/* Shift the canvas by (dx,dy) cells, wrapping around the edges */
+static int shift_wrap(int dx, int dy) {
+    int w = CELLS_X, h = CELLS_Y;
+    dx = ((dx % w) + w) % w;
+    dy = ((dy % h) + h) % h;
+    if (dx == 0 && dy == 0) return 0;
+    uint8_t *dst = canvas_alloc(w, h);
+    if (!dst) return -1;
+    for (int y=0;y<h;y++){
+        const uint8_t *src = canvas + (size_t)y*w;
+        uint8_t *d = dst + (size_t)((y + dy) % h)*w;
+        memcpy(d + dx, src, w - dx);
+        memcpy(d, src + w - dx, dx);
+    }
+    if (edit_touch(0, 0, w-1, h-1) != 0) { arena_release(doc_arena(), dst); return -1; }
+    replace_canvas(dst, w, h);
+    return 0;
+}
+
+/* Resize to nw x nh keeping the contents; anchor 0..8 picks which part of
+   the old canvas stays fixed (0 = top-left, 4 = center, 8 = bottom-right) */
+static int resize_canvas(int nw, int nh, int anchor) {
+    if (!dims_valid(nw, nh)) return -1;
+    uint8_t *dst = (uint8_t*)arena_calloc(doc_arena(), (size_t)nw * nh);
+    if (!dst) return -1;
+    int ox = (nw - CELLS_X) * (anchor % 3) / 2; /* old canvas origin inside the new one */
+    int oy = (nh - CELLS_Y) * (anchor / 3) / 2;
+    int x0 = ox < 0 ? -ox : 0, x1 = CELLS_X < nw - ox ? CELLS_X : nw - ox;
+    for (int y=0;y<CELLS_Y;y++){
+        int ny = y + oy;
+        if (ny < 0 || ny >= nh || x0 >= x1) continue;
+        memcpy(dst + (size_t)ny*nw + ox + x0, canvas + (size_t)y*CELLS_X + x0, x1 - x0);
+    }
+    replace_canvas(dst, nw, nh);
+    return 0;
+}
+
+static void set_zoom_level(int level) {
+    zoom_level = level < ZOOM_LEVEL_MIN ? ZOOM_LEVEL_MIN : level > ZOOM_LEVEL_MAX ? ZOOM_LEVEL_MAX : level;
+    zoom = pow(2.0, zoom_level / 4.0);
+}
+
+/* Park the active document's globals in its slot */
+static void doc_store() {
+    Document *d = &docs[doc_cur];
+    d->canvas = canvas; d->cells_x = CELLS_X; d->cells_y = CELLS_Y;
+    memcpy(d->palette, palette, sizeof(palette));
+    memcpy(d->history, history, sizeof(history));
+    d->history_count = history_count; d->history_pos = history_pos;
+    d->edit_seen = edit_seen; d->edit_seen_count = edit_seen_count;
+    d->sel_active = sel_active; d->sel_x0 = sel_x0; d->sel_y0 = sel_y0; d->sel_x1 = sel_x1; d->sel_y1 = sel_y1;
+    d->zoom_level = zoom_level; d->pan_x = pan_x; d->pan_y = pan_y;
+}
+
+static void parallel_rows(void (*fn)(void *ctx, int y0, int y1), void *ctx, int rows);
+
+/* Keep a parked document's canvas as an RLE blob when that is at most
+   1/RLE_RATIO of its flat size; the flat buffer goes back to the arena */
+static void doc_pack(Document *d) {
+    if (!d->canvas) return;
+    size_t n = (size_t)d->cells_x * d->cells_y;
+    size_t size = rle_size(d->canvas, d->cells_x, d->cells_y, d->cells_x, n / RLE_RATIO);
+    uint8_t *blob = size ? (uint8_t*)arena_alloc(&d->arena, size) : NULL;
+    if (!blob) return;
+    rle_encode(blob, d->canvas, d->cells_x, d->cells_y, d->cells_x);
+    arena_release(&d->arena, d->canvas);
+    d->canvas = NULL;
+    d->rle = blob;
+}
+
+/* Expand a packed document back to a flat canvas, -1 when out of memory */
+static int doc_unpack(Document *d) {
+    if (!d->rle) return 0;
+    uint8_t *cells = (uint8_t*)arena_alloc(&d->arena, (size_t)d->cells_x * d->cells_y);
+    if (!cells) return -1;
+    RleJob j = { d->rle, cells, (size_t)d->cells_x };
+    parallel_rows(rle_band, &j, d->cells_y);
+    arena_release(&d->arena, d->rle);
+    d->rle = NULL;
+    d->canvas = cells;
+    return 0;
+}
+
+/* Make document i the active one; the renderer gets all of its cells.
+   -1 when it cannot be unpacked, and the active document stays. */
+static int doc_load(int i) {
+    Document *d = &docs[i];
+    if (doc_unpack(d) != 0) {
+        printf("Not enough memory to open %s\n", d->name);
+        return -1;
+    }
+    doc_cur = i;
+    d->last_use = ++doc_clock;
+    canvas = d->canvas; CELLS_X = d->cells_x; CELLS_Y = d->cells_y;
+    memcpy(palette, d->palette, sizeof(palette));
+    pack_palette();
+    memcpy(history, d->history, sizeof(history));
+    history_count = d->history_count; history_pos = d->history_pos;
+    edit_seen = d->edit_seen; edit_seen_count = d->edit_seen_count;
+    sel_active = d->sel_active; sel_x0 = d->sel_x0; sel_y0 = d->sel_y0; sel_x1 = d->sel_x1; sel_y1 = d->sel_y1;
+    set_zoom_level(d->zoom_level);
+    pan_x = d->pan_x; pan_y = d->pan_y;
+    dirty_count = 0;
+    mark_all_dirty();
+    journal_canvas_pending = 1;
+    return 0;
+}
+
+static void doc_switch(int i) {
+    if (i == doc_cur || i < 0 || i >= doc_count) return;
+    if (doc_unpack(&docs[i]) != 0) {
+        printf("Not enough memory to switch to %s\n", docs[i].name);
+        return;
+    }
+    doc_store();
+    doc_pack(&docs[doc_cur]);
+    doc_load(i);
+}
+
+/* Open a blank w x h document with the default palette and make it active */
+static int doc_new(int w, int h) {
+    static int serial = 1;
+    if (doc_count == DOC_MAX || !dims_valid(w, h)) return -1;
+    Document *d = &docs[doc_count];
+    memset(d, 0, sizeof(*d));
+    d->canvas = (uint8_t*)arena_calloc(&d->arena, (size_t)w * h);
+    if (!d->canvas) return -1;
+    snprintf(d->name, sizeof(d->name), "untitled %d", ++serial);
+    d->cells_x = w; d->cells_y = h;
+    d->zoom_level = zoom_level;
+    d->ws_entry = -1;
+    doc_store();
+    doc_pack(&docs[doc_cur]);
+    doc_load(doc_count++);
+    init_default_palette();
+    return 0;
+}
+
+/* Close document i, freeing its canvas, history and scratch in one go; the
+   last open document cannot be closed, nor the active one when the document
+   that would take its place cannot be unpacked */
+static int doc_remove(int i) {
+    if (doc_count == 1) return -1;
+    if (i == doc_cur) {
+        Document *next = &docs[i + 1 < doc_count ? i + 1 : i - 1];
+        if (doc_unpack(next) != 0) {
+            printf("Not enough memory to open %s\n", next->name);
+            return -1;
+        }
+    }
+    arena_free(&docs[i].arena);
+    memmove(&docs[i], &docs[i + 1], sizeof(Document) * (doc_count - i - 1));
+    doc_count--;
+    if (i < doc_cur) doc_cur--;
+    else if (i == doc_cur) doc_load(doc_cur < doc_count ? doc_cur : doc_count - 1);
+    return 0;
+}
+
+static int doc_close() {
+    return doc_remove(doc_cur);
+}
+
+/* Everything the renderer needs besides the cells themselves. The input
+   thread captures it with current_view() for every frame it hands over. */
+typedef struct {
+    int cells_x, cells_y, tile_mode;
+    double zoom, pan_x, pan_y;
+    int view_w, view_h;
+    int show_grid, symmetry, current_color, secondary_color;
+    int ref_mode, bg_clear; /* bg_clear: index 0 is see-through (reference under the canvas) */
+    int sel_active, sel_x0, sel_y0, sel_x1, sel_y1;
+    int shape_active, shape_color;
+    int rot_active, rot_x, rot_y, rot_w, rot_h;
+    int preview_scale; /* actual-size preview window: 0 = closed, else pixels per cell */
+    SDL_Color palette[PALETTE_COUNT]; /* the active document's */
+    uint32_t palette_argb[PALETTE_COUNT];
+    int browser, browser_top;   /* workspace browser shown instead of the canvas; first thumbnail row */
+    int ws_count, ws_current;   /* workspace entries; the active document's entry or -1 */
+} ViewState;
+static ViewState current_view();
+
+/* Canvas view, in window points. Cells are drawn view_cell_size() points
+   wide; in tile mode the canvas is shown 3x3 at a third of the size, and the
+   center copy is the one tools and overlays refer to. */
+static double view_cell_size(const ViewState *v) {
+    return v->tile_mode ? v->zoom / 3.0 : v->zoom;
+}
+static double view_origin_x(const ViewState *v) { return v->pan_x + (v->tile_mode ? v->cells_x * view_cell_size(v) : 0); }
+static double view_origin_y(const ViewState *v) { return v->pan_y + (v->tile_mode ? v->cells_y * view_cell_size(v) : 0); }
+
+/* Size of the canvas (all copies in tile mode) at the current zoom */
+static int view_canvas_w(const ViewState *v) { return (int)ceil(v->cells_x * v->zoom); }
+static int view_canvas_h(const ViewState *v) { return (int)ceil(v->cells_y * v->zoom); }
+
+/* Width of the window area left of the side panel, where the canvas is shown */
+static int view_area_w(const ViewState *v) { return v->view_w > PANEL_W ? v->view_w - PANEL_W : 0; }
+
+/* Workspace browser: a grid of thumbnails in the canvas area, scrolled by rows */
+#define THUMB_SIZE 64
+#define THUMB_CELL (THUMB_SIZE + 12)
+static int browser_cols(const ViewState *v) { int c = (view_area_w(v) - 8) / THUMB_CELL; return c > 0 ? c : 1; }
+static int browser_rows(const ViewState *v) { return (v->view_h - 8) / THUMB_CELL + 1; } /* including a partly visible one */
+static SDL_Rect browser_cell(const ViewState *v, int e) {
+    int i = e - v->browser_top * browser_cols(v);
+    SDL_Rect r = { 8 + (i % browser_cols(v)) * THUMB_CELL, 8 + (i / browser_cols(v)) * THUMB_CELL, THUMB_SIZE, THUMB_SIZE };
+    return r;
+}
+
+/* Entry under a window position, or -1 */
+static int browser_hit(const ViewState *v, int px, int py) {
+    if (px < 8 || py < 8 || px >= view_area_w(v)) return -1;
+    int col = (px - 8) / THUMB_CELL, row = (py - 8) / THUMB_CELL;
+    if (col >= browser_cols(v) || (px - 8) % THUMB_CELL >= THUMB_SIZE || (py - 8) % THUMB_CELL >= THUMB_SIZE) return -1;
+    int e = (v->browser_top + row) * browser_cols(v) + col;
+    return e < v->ws_count ? e : -1;
+}
+
+/* Window rectangle covering w x h cells at (x,y) of the center copy */
+static SDL_Rect view_rect(const ViewState *v, int x, int y, int w, int h) {
+    double cs = view_cell_size(v);
+    int x0 = (int)floor(view_origin_x(v) + x*cs), y0 = (int)floor(view_origin_y(v) + y*cs);
+    int x1 = (int)floor(view_origin_x(v) + (x + w)*cs), y1 = (int)floor(view_origin_y(v) + (y + h)*cs);
+    SDL_Rect r = { x0, y0, x1 - x0, y1 - y0 };
+    return r;
+}
+
+/* Cell under a window position; floors, so points left/above the canvas stay
+   negative. In tile mode the neighbouring copies give cells outside the
+   canvas, which the span rasterizer wraps. */
+static void cell_from_window(const ViewState *v, int px, int py, int *cx, int *cy) {
+    double cs = view_cell_size(v);
+    *cx = (int)floor((px - view_origin_x(v)) / cs);
+    *cy = (int)floor((py - view_origin_y(v)) / cs);
+}
+
+/* Reference image for tracing. The input thread loads it and hands the
+   surface to the renderer, which scales it once into a texture that fits the
+   canvas view; the texture is only rebuilt when the view size changes, so a
+   visible reference costs one RenderCopy a frame. */
+#define REF_ALPHA 128
+enum { REF_UNDER = 0, REF_OVER, REF_HIDDEN, REF_MODE_COUNT };
+static const char *ref_mode_names[REF_MODE_COUNT] = { "under canvas", "over canvas", "hidden" };
+static int ref_mode = REF_UNDER;
+static int ref_loaded = 0;
+static SDL_Surface *ref_pending = NULL; /* not yet handed to the renderer; NULL + ref_pending_set removes it */
+static int ref_pending_set = 0;
+
+static void reference_clear() {
+    if (ref_pending) SDL_FreeSurface(ref_pending);
+    ref_pending = NULL;
+    ref_pending_set = 1;
+    ref_loaded = 0;
+}
+
+static int reference_load(const char *filename) {
+    SDL_Surface *surf = SDL_LoadBMP(filename);
+    if (!surf) { fprintf(stderr, "SDL_LoadBMP failed: %s\n", SDL_GetError()); return -1; }
+    SDL_Surface *conv = SDL_ConvertSurfaceFormat(surf, SDL_PIXELFORMAT_ARGB8888, 0);
+    SDL_FreeSurface(surf);
+    if (!conv) { fprintf(stderr, "SDL_ConvertSurfaceFormat failed: %s\n", SDL_GetError()); return -1; }
+    reference_clear();
+    ref_pending = conv;
+    ref_loaded = 1;
+    SDL_SetSurfaceBlendMode(conv, SDL_BLENDMODE_NONE);
+    return 0;
+}
+
+/* One level of the canvas pyramid (see pyr_tile_texture), split into tiles */
+#define PYR_LEVELS 8
+#define PYR_TILE 256   /* texels per tile side, well below any renderer's texture limit */
+#define PYR_CACHE 256  /* tiles kept beyond that are dropped, least recently drawn first */
+typedef struct {
+    SDL_Texture *tex;
+    uint32_t *px;      /* levels >= 1: PYR_TILE x PYR_TILE colors; level 0 reads the cells instead */
+    Box dirty, stale;  /* tile coordinates. dirty: px out of date; stale: texture out of date */
+    int has_dirty, has_stale;
+    unsigned used;     /* frame it was last drawn in */
+} PyrTile;
+
+typedef struct {
+    int w, h;          /* texels */
+    int tx, ty;        /* tiles */
+    PyrTile ***rows;   /* ty rows of tx tiles; rows and tiles exist only once drawn */
+} PyrLevel;
+
+/* Renderer-side state, only touched by the thread that renders: the frame's
+   view, a copy of the cells and the canvas pyramid (level 0 is one texel per
+   cell), both kept current from the cell regions sent with each frame, the
+   navigator, the actual-size preview and copies of the overlays */
+static struct {
+    ViewState v;
+    double dpi;                  /* output pixels per window point */
+    uint8_t *cells;
+    MapRegion cells_map;         /* backs cells when the canvas is at least map_threshold */
+    PyrLevel lvl[PYR_LEVELS];
+    unsigned pyr_frame;          /* canvas draws so far */
+    int pyr_live;                /* tiles in lvl */
+    struct {
+        SDL_Texture *tex;
+        uint32_t *px;            /* w x h, as received from the input thread */
+        int w, h;
+        Box stale;               /* texels received since the last upload */
+        int has_stale;
+    } nav;
+    struct {
+        SDL_Texture **pages;     /* atlases of THUMB_PAGE x THUMB_PAGE thumbnails */
+        int npages;
+        uint16_t *size;          /* per entry: w << 8 | h once uploaded, else 0 */
+        int count;
+        struct { int e, w, h; uint32_t *px; } *pending; /* received, not uploaded yet */
+        int npending, pending_cap;
+    } th;
+    struct {
+        SDL_Texture *tex;        /* one texel per cell, on the preview window's renderer */
+        Box stale;               /* cells changed since the last upload */
+        int has_stale;
+    } pv;
+    Span *spans;                 /* shape preview */
+    int span_count, span_cap;
+    SDL_Rect *rects;
+    int rect_cap;
+    uint8_t *rot_out;            /* rotate preview */
+    int rot_ox, rot_oy, rot_ow, rot_oh;
+    SDL_Texture *rot_tex;
+    int rot_tex_size;
+    SDL_Surface *ref_src;        /* reference image, ARGB8888 */
+    SDL_Texture *ref_tex;        /* ref_src scaled to ref_tex_w x ref_tex_h output pixels */
+    int ref_tex_w, ref_tex_h;
+} rd;
+
+static void render_cells_free() {
+    if (rd.cells_map.base) map_destroy(&rd.cells_map);
+    else free(rd.cells);
+    rd.cells = NULL;
+}
+
+/* With --map-dir, the renderer only holds the cells in view of a canvas as
+   large as the ones that are mapped */
+static int render_sparse() { return map_dir[0] && cell_count() >= map_threshold; }
+
+/* Zeroed render copy of the canvas, file-backed like the canvas itself when large */
+static void render_cells_alloc(size_t n) {
+    render_cells_free();
+    if (n >= map_threshold && map_create(&rd.cells_map, n) == 0) rd.cells = (uint8_t*)rd.cells_map.base;
+    else rd.cells = (uint8_t*)calloc(n, 1);
+}
+
+static void pyr_free();
+
+static void render_release() {
+    pyr_free();
+    if (rd.nav.tex) SDL_DestroyTexture(rd.nav.tex);
+    free(rd.nav.px);
+    if (rd.pv.tex) SDL_DestroyTexture(rd.pv.tex);
+    for (int i=0;i<rd.th.npages;i++) if (rd.th.pages[i]) SDL_DestroyTexture(rd.th.pages[i]);
+    for (int i=0;i<rd.th.npending;i++) free(rd.th.pending[i].px);
+    free(rd.th.pages);
+    free(rd.th.size);
+    free(rd.th.pending);
+    render_cells_free();
+    if (rd.rot_tex) SDL_DestroyTexture(rd.rot_tex);
+    if (rd.ref_tex) SDL_DestroyTexture(rd.ref_tex);
+    if (rd.ref_src) SDL_FreeSurface(rd.ref_src);
+    free(rd.spans);
+    free(rd.rects);
+    free(rd.rot_out);
+    memset(&rd, 0, sizeof(rd));
+}
+
+/* Draw the reference fitted (aspect kept) and centered on the canvas view,
+   rescaling the cached texture only if the fitted size changed. The texture
+   is scaled to output pixels, so it stays sharp on HiDPI displays. */
+static void draw_reference(SDL_Renderer *ren) {
+    SDL_Rect view = view_rect(&rd.v, 0, 0, rd.v.cells_x, rd.v.cells_y);
+    double sx = (double)view.w / rd.ref_src->w, sy = (double)view.h / rd.ref_src->h;
+    double sc = sx < sy ? sx : sy;
+    int w = (int)(rd.ref_src->w * sc + 0.5), h = (int)(rd.ref_src->h * sc + 0.5);
+    if (w < 1) w = 1;
+    if (h < 1) h = 1;
+    int pw = (int)(w * rd.dpi + 0.5), ph = (int)(h * rd.dpi + 0.5);
+    if (pw < 1) pw = 1;
+    if (ph < 1) ph = 1;
+    if (!rd.ref_tex || pw != rd.ref_tex_w || ph != rd.ref_tex_h) {
+        if (rd.ref_tex) SDL_DestroyTexture(rd.ref_tex);
+        rd.ref_tex = NULL;
+        SDL_Surface *scaled = SDL_CreateRGBSurfaceWithFormat(0, pw, ph, 32, SDL_PIXELFORMAT_ARGB8888);
+        if (!scaled) return;
+        if (SDL_BlitScaled(rd.ref_src, NULL, scaled, NULL) == 0) rd.ref_tex = SDL_CreateTextureFromSurface(ren, scaled);
+        SDL_FreeSurface(scaled);
+        if (!rd.ref_tex) { fprintf(stderr, "reference texture failed: %s\n", SDL_GetError()); return; }
+        SDL_SetTextureBlendMode(rd.ref_tex, SDL_BLENDMODE_BLEND);
+        SDL_SetTextureAlphaMod(rd.ref_tex, REF_ALPHA);
+        rd.ref_tex_w = pw; rd.ref_tex_h = ph;
+    }
+    SDL_Rect dst = { view.x + (view.w - w)/2, view.y + (view.h - h)/2, w, h };
+    SDL_RenderCopy(ren, rd.ref_tex, NULL, &dst);
+}
+
+/* Mipmap pyramid for zoomed-out views. Level l is the canvas downsampled by
+   2^l, each texel the average color (alpha included) of the 2^l x 2^l cells
+   under it; level 0 is the cells themselves. Every level is cut into
+   PYR_TILE x PYR_TILE tiles, each its own texture, created when it is first
+   drawn and dropped again (PYR_CACHE) when it has not been drawn for a
+   while. Cell changes only mark the regions of existing tiles dirty; drawing
+   picks the level whose texels are closest to one screen pixel and brings
+   just the tiles in view current, so frame cost follows the screen size,
+   not the canvas, and no texture ever exceeds the renderer's limit. */
+static void box_add(Box *acc, int *has, Box b) {
+    *acc = *has ? box_union(*acc, b) : b;
+    *has = 1;
+}
+
+static void pyr_lut(uint32_t lut[PALETTE_COUNT]) {
+    memcpy(lut, rd.v.palette_argb, sizeof(uint32_t) * PALETTE_COUNT);
+    if (rd.v.bg_clear) lut[0] &= 0x00FFFFFFu;
+}
+
+/* Convert the cells in b, offset by (ox, oy), through lut and upload them to
+   texels b of a texture with one texel per cell; 0 on success */
+static int upload_cells(SDL_Texture *tex, Box b, int ox, int oy, const uint32_t lut[PALETTE_COUNT]) {
+    SDL_Rect r = { b.x0, b.y0, b.x1 - b.x0 + 1, b.y1 - b.y0 + 1 };
+    void *pixels; int pitch;
+    if (SDL_LockTexture(tex, &r, &pixels, &pitch) != 0) return -1;
+    for (int y=0;y<r.h;y++){
+        uint32_t *dst = (uint32_t*)((uint8_t*)pixels + (size_t)y*pitch);
+        const uint8_t *src = rd.cells + (size_t)(oy + r.y + y) * rd.v.cells_x + ox + r.x;
+        for (int x=0;x<r.w;x++) dst[x] = lut[src[x]];
+    }
+    SDL_UnlockTexture(tex);
+    return 0;
+}
+
+static void pyr_tile_free(PyrTile *t) {
+    if (t->tex) SDL_DestroyTexture(t->tex);
+    free(t->px);
+    free(t);
+    rd.pyr_live--;
+}
+
+static void pyr_free() {
+    for (int l=0;l<PYR_LEVELS;l++){
+        PyrLevel *p = &rd.lvl[l];
+        for (int y=0; p->rows && y<p->ty; y++){
+            if (!p->rows[y]) continue;
+            for (int x=0;x<p->tx;x++) if (p->rows[y][x]) pyr_tile_free(p->rows[y][x]);
+            free(p->rows[y]);
+        }
+        free(p->rows);
+        memset(p, 0, sizeof(*p));
+    }
+}
+
+/* Drop every tile and size the levels for the current canvas */
+static void pyr_reset() {
+    pyr_free();
+    for (int l=0;l<PYR_LEVELS;l++){
+        PyrLevel *p = &rd.lvl[l];
+        p->w = (rd.v.cells_x + (1 << l) - 1) >> l;
+        p->h = (rd.v.cells_y + (1 << l) - 1) >> l;
+        p->tx = (p->w + PYR_TILE - 1) / PYR_TILE;
+        p->ty = (p->h + PYR_TILE - 1) / PYR_TILE;
+        p->rows = (PyrTile***)calloc(p->ty, sizeof(PyrTile**));
+    }
+}
+
+/* Cells in b changed: the tiles over them need an upload (level 0) or a
+   recompute (the levels above). Tiles not created yet start out complete. */
+static void pyr_touch(Box b) {
+    for (int l=0;l<PYR_LEVELS;l++){
+        PyrLevel *p = &rd.lvl[l];
+        if (!p->rows) continue;
+        Box s = { b.x0 >> l, b.y0 >> l, b.x1 >> l, b.y1 >> l };
+        for (int ty=s.y0/PYR_TILE; ty<=s.y1/PYR_TILE && ty<p->ty; ty++){
+            if (!p->rows[ty]) continue;
+            for (int tx=s.x0/PYR_TILE; tx<=s.x1/PYR_TILE && tx<p->tx; tx++){
+                PyrTile *t = p->rows[ty][tx];
+                if (!t) continue;
+                Box in = { s.x0 - tx*PYR_TILE, s.y0 - ty*PYR_TILE, s.x1 - tx*PYR_TILE, s.y1 - ty*PYR_TILE };
+                if (in.x0 < 0) in.x0 = 0;
+                if (in.y0 < 0) in.y0 = 0;
+                if (in.x1 >= PYR_TILE) in.x1 = PYR_TILE - 1;
+                if (in.y1 >= PYR_TILE) in.y1 = PYR_TILE - 1;
+                if (l == 0) box_add(&t->stale, &t->has_stale, in);
+                else box_add(&t->dirty, &t->has_dirty, in);
+            }
+        }
+    }
+}
+
+/* Recompute the dirty texels of tile (tx, ty) of level l >= 1 straight from
+   the cells, so a level never depends on tiles of the others */
+static void pyr_compute(int l, PyrTile *t, int tx, int ty, int tw, int th, const uint32_t lut[PALETTE_COUNT]) {
+    if (!t->has_dirty) return;
+    Box d = t->dirty;
+    if (d.x1 >= tw) d.x1 = tw - 1;
+    if (d.y1 >= th) d.y1 = th - 1;
+    int cw = rd.v.cells_x, ch = rd.v.cells_y;
+    for (int y=d.y0; y<=d.y1; y++){
+        int cy0 = (ty*PYR_TILE + y) << l, cy1 = cy0 + (1 << l) < ch ? cy0 + (1 << l) : ch;
+        for (int x=d.x0; x<=d.x1; x++){
+            int cx0 = (tx*PYR_TILE + x) << l, cx1 = cx0 + (1 << l) < cw ? cx0 + (1 << l) : cw;
+            unsigned a = 0, r = 0, g = 0, b = 0, n = 0;
+            for (int cy=cy0; cy<cy1; cy++){
+                const uint8_t *row = rd.cells + (size_t)cy * cw;
+                for (int cx=cx0; cx<cx1; cx++){
+                    uint32_t c = lut[row[cx]];
+                    a += c >> 24; r += (c >> 16) & 0xFF; g += (c >> 8) & 0xFF; b += c & 0xFF;
+                }
+                n += cx1 - cx0;
+            }
+            t->px[y * PYR_TILE + x] = ((a/n) << 24) | ((r/n) << 16) | ((g/n) << 8) | (b/n);
+        }
+    }
+    t->has_dirty = 0;
+    box_add(&t->stale, &t->has_stale, d);
+}
+
+/* Tile (tx, ty) of level l, created if need be, brought current and uploaded */
+static SDL_Texture *pyr_tile_texture(SDL_Renderer *ren, int l, int tx, int ty) {
+    PyrLevel *p = &rd.lvl[l];
+    if (!rd.cells || !p->rows) return NULL;
+    if (!p->rows[ty] && !(p->rows[ty] = (PyrTile**)calloc(p->tx, sizeof(PyrTile*)))) return NULL;
+    int tw = p->w - tx*PYR_TILE < PYR_TILE ? p->w - tx*PYR_TILE : PYR_TILE;
+    int th = p->h - ty*PYR_TILE < PYR_TILE ? p->h - ty*PYR_TILE : PYR_TILE;
+    Box all = { 0, 0, tw - 1, th - 1 };
+    PyrTile *t = p->rows[ty][tx];
+    if (!t) {
+        t = (PyrTile*)calloc(1, sizeof(PyrTile));
+        if (!t) return NULL;
+        if (l > 0 && !(t->px = (uint32_t*)malloc(sizeof(uint32_t) * PYR_TILE * PYR_TILE))) { free(t); return NULL; }
+        p->rows[ty][tx] = t;
+        rd.pyr_live++;
+        if (l > 0) box_add(&t->dirty, &t->has_dirty, all);
+    }
+    t->used = rd.pyr_frame;
+    uint32_t lut[PALETTE_COUNT];
+    pyr_lut(lut);
+    if (l > 0) pyr_compute(l, t, tx, ty, tw, th, lut);
+    if (!t->tex) {
+        t->tex = SDL_CreateTexture(ren, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, tw, th);
+        if (!t->tex) { fprintf(stderr, "SDL_CreateTexture failed: %s\n", SDL_GetError()); return NULL; }
+        SDL_SetTextureBlendMode(t->tex, SDL_BLENDMODE_BLEND);
+        t->stale = all;
+        t->has_stale = 1;
+    }
+    if (t->has_stale) {
+        Box s = t->stale;
+        if (s.x1 >= tw) s.x1 = tw - 1;
+        if (s.y1 >= th) s.y1 = th - 1;
+        if (l == 0) {
+            if (upload_cells(t->tex, s, tx*PYR_TILE, ty*PYR_TILE, lut) == 0) t->has_stale = 0;
+        } else {
+            SDL_Rect r = { s.x0, s.y0, s.x1 - s.x0 + 1, s.y1 - s.y0 + 1 };
+            if (SDL_UpdateTexture(t->tex, &r, t->px + r.y * PYR_TILE + r.x, PYR_TILE * 4) == 0) t->has_stale = 0;
+        }
+    }
+    return t->tex;
+}
+
+/* Over PYR_CACHE tiles: drop those not drawn in the last two frames (down to
+   3/4 of the cache, so this does not run every frame), and rows left empty */
+static void pyr_trim() {
+    if (rd.pyr_live <= PYR_CACHE) return;
+    for (int l=0; l<PYR_LEVELS && rd.pyr_live > PYR_CACHE * 3 / 4; l++){
+        PyrLevel *p = &rd.lvl[l];
+        for (int y=0; p->rows && y<p->ty; y++){
+            if (!p->rows[y]) continue;
+            int left = 0;
+            for (int x=0;x<p->tx;x++){
+                PyrTile *t = p->rows[y][x];
+                if (!t) continue;
+                if (rd.pyr_frame - t->used >= 2 && rd.pyr_live > PYR_CACHE * 3 / 4) {
+                    pyr_tile_free(t);
+                    p->rows[y][x] = NULL;
+                } else left++;
+            }
+            if (!left) { free(p->rows[y]); p->rows[y] = NULL; }
+        }
+    }
+}
+
+/* Draw the tiles of level l over the visible cells vis (canvas coordinates)
+   of the copy of the canvas at cell offset (ox, oy) */
+static void pyr_draw(SDL_Renderer *ren, int l, Box vis, int ox, int oy) {
+    const ViewState *v = &rd.v;
+    if (vis.x0 < 0) vis.x0 = 0;
+    if (vis.y0 < 0) vis.y0 = 0;
+    if (vis.x1 >= v->cells_x) vis.x1 = v->cells_x - 1;
+    if (vis.y1 >= v->cells_y) vis.y1 = v->cells_y - 1;
+    if (vis.x0 > vis.x1 || vis.y0 > vis.y1) return;
+    int span = PYR_TILE << l; /* cells per tile side */
+    for (int ty=vis.y0/span; ty<=vis.y1/span; ty++){
+        for (int tx=vis.x0/span; tx<=vis.x1/span; tx++){
+            SDL_Texture *tex = pyr_tile_texture(ren, l, tx, ty);
+            if (!tex) continue;
+            int cx = tx*span, cy = ty*span;
+            int cw = v->cells_x - cx < span ? v->cells_x - cx : span;
+            int ch = v->cells_y - cy < span ? v->cells_y - cy : span;
+            SDL_Rect r = view_rect(v, ox + cx, oy + cy, cw, ch);
+            SDL_RenderCopy(ren, tex, NULL, &r);
+        }
+    }
+}
+
+/* Coarsest level whose texels still map to at most one output pixel */
+static int pyr_level_for(const ViewState *v) {
+    double cs = view_cell_size(v) * rd.dpi;
+    int l = 0;
+    while (l + 1 < PYR_LEVELS && cs * (1 << (l + 1)) <= 1.0 && rd.lvl[l + 1].w > 1 && rd.lvl[l + 1].h > 1) l++;
+    return l;
+}
+
+static void draw_canvas_to_renderer(SDL_Renderer *ren) {
+    const ViewState *v = &rd.v;
+    int copies = v->tile_mode ? 3 : 1;
+    int level = pyr_level_for(v);
+    int has_ref = rd.ref_src && v->ref_mode != REF_HIDDEN;
+    if (has_ref && v->ref_mode == REF_UNDER) {
+        /* background color behind the transparent canvas, then the reference */
+        SDL_Rect bg = view_rect(v, -(copies/2)*v->cells_x, -(copies/2)*v->cells_y, copies*v->cells_x, copies*v->cells_y);
+        SDL_SetRenderDrawColor(ren, rd.v.palette[0].r, rd.v.palette[0].g, rd.v.palette[0].b, 255);
+        SDL_RenderFillRect(ren, &bg);
+        draw_reference(ren);
+    }
+    /* only the tiles in view; tile mode reuses them for all nine copies */
+    Box vis;
+    cell_from_window(v, 0, 0, &vis.x0, &vis.y0);
+    cell_from_window(v, view_area_w(v) - 1, v->view_h - 1, &vis.x1, &vis.y1);
+    rd.pyr_frame++;
+    for (int j=0;j<copies;j++) for (int i=0;i<copies;i++){
+        int ox = (i - copies/2)*v->cells_x, oy = (j - copies/2)*v->cells_y;
+        Box in = { vis.x0 - ox, vis.y0 - oy, vis.x1 - ox, vis.y1 - oy };
+        pyr_draw(ren, level, in, ox, oy);
+    }
+    pyr_trim();
+    if (has_ref && v->ref_mode == REF_OVER) draw_reference(ren);
+    SDL_Rect dst = view_rect(v, 0, 0, v->cells_x, v->cells_y);
+    if (v->show_grid && view_cell_size(v) >= 4) {
+        /* only the lines in view, so a zoomed-in large canvas costs what the window shows */
+        SDL_SetRenderDrawColor(ren, 200, 200, 200, 255);
+        for (int j=0;j<copies;j++) for (int i=0;i<copies;i++){
+            int ox = (i - copies/2)*v->cells_x, oy = (j - copies/2)*v->cells_y;
+            int x0 = vis.x0 - ox > 0 ? vis.x0 - ox : 0, x1 = vis.x1 - ox + 1 < v->cells_x ? vis.x1 - ox + 1 : v->cells_x;
+            int y0 = vis.y0 - oy > 0 ? vis.y0 - oy : 0, y1 = vis.y1 - oy + 1 < v->cells_y ? vis.y1 - oy + 1 : v->cells_y;
+            if (x0 > x1 || y0 > y1) continue;
+            SDL_Rect c = view_rect(v, ox + x0, oy + y0, x1 - x0, y1 - y0);
+            for (int x=x0;x<=x1;x++){ int px = view_rect(v, ox + x, 0, 0, 0).x; SDL_RenderDrawLine(ren, px, c.y, px, c.y + c.h); }
+            for (int y=y0;y<=y1;y++){ int py = view_rect(v, 0, oy + y, 0, 0).y; SDL_RenderDrawLine(ren, c.x, py, c.x + c.w, py); }
+        }
+    }
+    if (v->tile_mode) {
+        SDL_SetRenderDrawColor(ren, 255, 128, 0, 255);
+        SDL_RenderDrawRect(ren, &dst);
+    }
+    /* symmetry axes */
+    SDL_SetRenderDrawColor(ren, 0, 160, 255, 255);
+    if (v->symmetry == SYM_H || v->symmetry == SYM_4) SDL_RenderDrawLine(ren, dst.x + dst.w/2, dst.y, dst.x + dst.w/2, dst.y + dst.h);
+    if (v->symmetry == SYM_V || v->symmetry == SYM_4) SDL_RenderDrawLine(ren, dst.x, dst.y + dst.h/2, dst.x + dst.w, dst.y + dst.h/2);
+}
+
+static void draw_selection(SDL_Renderer *ren) {
+    const ViewState *v = &rd.v;
+    if (!v->sel_active) return;
+    SDL_Rect r = view_rect(v, v->sel_x0, v->sel_y0, v->sel_x1 - v->sel_x0 + 1, v->sel_y1 - v->sel_y0 + 1);
+    SDL_SetRenderDrawColor(ren, 255, 0, 255, 255);
+    SDL_RenderDrawRect(ren, &r);
+}
+
+/* Clamp the dragged selection corners to the canvas and order them */
+static void set_selection(int ax, int ay, int bx, int by) {
+    if (ax > bx) { int t = ax; ax = bx; bx = t; }
+    if (ay > by) { int t = ay; ay = by; by = t; }
+    sel_x0 = ax < 0 ? 0 : ax;
+    sel_y0 = ay < 0 ? 0 : ay;
+    sel_x1 = bx >= CELLS_X ? CELLS_X-1 : bx;
+    sel_y1 = by >= CELLS_Y ? CELLS_Y-1 : by;
+    sel_active = sel_x0 <= sel_x1 && sel_y0 <= sel_y1;
+}
+
+/* Draw the in-progress shape on top of the canvas: one rect per span, one
+   draw call per visible copy of the canvas */
+static void draw_shape_preview(SDL_Renderer *ren) {
+    const ViewState *v = &rd.v;
+    if (!v->shape_active) return;
+    if (rd.span_count > rd.rect_cap) {
+        SDL_Rect *nr = (SDL_Rect*)realloc(rd.rects, sizeof(SDL_Rect) * rd.span_count);
+        if (!nr) return;
+        rd.rects = nr;
+        rd.rect_cap = rd.span_count;
+    }
+    SDL_Color c = rd.v.palette[v->shape_color];
+    SDL_SetRenderDrawColor(ren, c.r, c.g, c.b, c.a);
+    int copies = v->tile_mode ? 3 : 1;
+    for (int cj=0;cj<copies;cj++) for (int ci=0;ci<copies;ci++){
+        int n = 0;
+        for (int i=0;i<rd.span_count;i++){
+            int y = rd.spans[i].y, x0 = rd.spans[i].x0, x1 = rd.spans[i].x1;
+            if (y < 0 || y >= v->cells_y) continue;
+            if (x0 < 0) x0 = 0;
+            if (x1 >= v->cells_x) x1 = v->cells_x-1;
+            if (x0 > x1) continue;
+            rd.rects[n++] = view_rect(v, x0 + (ci - copies/2)*v->cells_x, y + (cj - copies/2)*v->cells_y, x1 - x0 + 1, 1);
+        }
+        SDL_RenderFillRects(ren, rd.rects, n);
+    }
+}
+
+static void draw_palette_ui(SDL_Renderer *ren, int win_w, int win_h) {
+    const ViewState *v = &rd.v;
+    int pal_x = view_area_w(v) + 10;
+    int pal_y = 10;
+    int box = 24;
+    for (int i=0;i<PALETTE_COUNT;i++){
+        SDL_Rect r = { pal_x + (i%2)*(box+8), pal_y + (i/2)*(box+8), box, box };
+        SDL_Color c = rd.v.palette[i];
+        SDL_SetRenderDrawColor(ren, c.r, c.g, c.b, c.a);
+        SDL_RenderFillRect(ren, &r);
+        SDL_SetRenderDrawColor(ren, 0,0,0,255);
+        SDL_RenderDrawRect(ren, &r);
+        if (i == v->current_color) {
+            SDL_Rect out = { r.x-2, r.y-2, r.w+4, r.h+4 };
+            SDL_SetRenderDrawColor(ren, 0,0,0,255);
+            SDL_RenderDrawRect(ren, &out);
+        }
+        if (i == v->secondary_color) {
+            SDL_Rect out = { r.x-4, r.y-4, r.w+8, r.h+8 };
+            SDL_SetRenderDrawColor(ren, 128,128,128,255);
+            SDL_RenderDrawRect(ren, &out);
+        }
+    }
+}
+
+/* Navigator: the whole canvas at reduced size below the palette, with the
+   visible part outlined. Each texel is the average color of a k x k block of
+   cells. The input thread computes the blocks (see navs_publish), since the
+   renderer's copy of a large canvas only holds the cells in view, and sends
+   the changed texels; the renderer only uploads them. */
+#define NAV_MAX 176
+
+static int nav_block(int cells_x, int cells_y) {
+    int m = cells_x > cells_y ? cells_x : cells_y;
+    return (m + NAV_MAX - 1) / NAV_MAX;
+}
+
+/* Texels in rect r of a w x h navigator arrived */
+static void nav_received(Box r, int w, int h, const uint32_t *px) {
+    if (w != rd.nav.w || h != rd.nav.h || !rd.nav.px) {
+        free(rd.nav.px);
+        rd.nav.px = (uint32_t*)calloc((size_t)w * h, sizeof(uint32_t));
+        if (rd.nav.tex) SDL_DestroyTexture(rd.nav.tex);
+        rd.nav.tex = NULL;
+        rd.nav.w = rd.nav.px ? w : 0; rd.nav.h = rd.nav.px ? h : 0;
+        rd.nav.has_stale = 0;
+        if (!rd.nav.px) return;
+    }
+    int rw = r.x1 - r.x0 + 1;
+    for (int y=r.y0; y<=r.y1; y++) memcpy(rd.nav.px + (size_t)y * w + r.x0, px + (size_t)(y - r.y0) * rw, sizeof(uint32_t) * rw);
+    box_add(&rd.nav.stale, &rd.nav.has_stale, r);
+}
+
+/* Upload the texels that arrived since the last frame */
+static void nav_update(SDL_Renderer *ren) {
+    if (!rd.nav.px) return;
+    if (!rd.nav.tex) {
+        rd.nav.tex = SDL_CreateTexture(ren, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, rd.nav.w, rd.nav.h);
+        if (!rd.nav.tex) return;
+        Box all = { 0, 0, rd.nav.w - 1, rd.nav.h - 1 };
+        rd.nav.stale = all;
+        rd.nav.has_stale = 1;
+    }
+    if (!rd.nav.has_stale) return;
+    Box s = rd.nav.stale;
+    SDL_Rect rect = { s.x0, s.y0, s.x1 - s.x0 + 1, s.y1 - s.y0 + 1 };
+    if (SDL_UpdateTexture(rd.nav.tex, &rect, rd.nav.px + (size_t)s.y0 * rd.nav.w + s.x0, rd.nav.w * 4) == 0) rd.nav.has_stale = 0;
+}
+
+static void draw_navigator(SDL_Renderer *ren, int win_h) {
+    const ViewState *v = &rd.v;
+    nav_update(ren);
+    if (!rd.nav.tex) return;
+    int big = rd.nav.w > rd.nav.h ? rd.nav.w : rd.nav.h;
+    int s = NAV_MAX / big > 0 ? NAV_MAX / big : 1;
+    SDL_Rect dst = { view_area_w(v) + 10, 10 + ((PALETTE_COUNT + 1) / 2) * 32 + 8, rd.nav.w * s, rd.nav.h * s };
+    SDL_RenderCopy(ren, rd.nav.tex, NULL, &dst);
+    SDL_SetRenderDrawColor(ren, 0, 0, 0, 255);
+    SDL_RenderDrawRect(ren, &dst);
+    /* cells of the (center) canvas visible left of the panel */
+    int cx0, cy0, cx1, cy1;
+    cell_from_window(v, 0, 0, &cx0, &cy0);
+    cell_from_window(v, view_area_w(v) - 1, win_h - 1, &cx1, &cy1);
+    if (cx0 < 0) cx0 = 0;
+    if (cy0 < 0) cy0 = 0;
+    if (cx1 >= v->cells_x) cx1 = v->cells_x - 1;
+    if (cy1 >= v->cells_y) cy1 = v->cells_y - 1;
+    if (cx0 > cx1 || cy0 > cy1) return;
+    double sc = (double)s / nav_block(v->cells_x, v->cells_y);
+    SDL_Rect vr = { dst.x + (int)(cx0 * sc), dst.y + (int)(cy0 * sc),
+                    (int)ceil((cx1 + 1) * sc) - (int)(cx0 * sc), (int)ceil((cy1 + 1) * sc) - (int)(cy0 * sc) };
+    SDL_SetRenderDrawColor(ren, 255, 0, 0, 255);
+    SDL_RenderDrawRect(ren, &vr);
+}
+
+/* Thumbnails arrive one RCMD_THUMB at a time and are kept in atlas pages,
+   so the browser draws each one with a RenderCopy from a shared texture */
+#define THUMB_PAGE 16
+static void thumbs_received(int e, int w, int h, uint32_t *px) {
+    if (rd.th.npending == rd.th.pending_cap) {
+        int ncap = rd.th.pending_cap ? rd.th.pending_cap * 2 : 32;
+        void *np = realloc(rd.th.pending, sizeof(*rd.th.pending) * ncap);
+        if (!np) { free(px); return; }
+        rd.th.pending = np;
+        rd.th.pending_cap = ncap;
+    }
+    rd.th.pending[rd.th.npending].e = e;
+    rd.th.pending[rd.th.npending].w = w;
+    rd.th.pending[rd.th.npending].h = h;
+    rd.th.pending[rd.th.npending].px = px;
+    rd.th.npending++;
+}
+
+static void thumbs_upload(SDL_Renderer *ren) {
+    const ViewState *v = &rd.v;
+    if (rd.th.npending && rd.th.count < v->ws_count) {
+        int np = (v->ws_count + THUMB_PAGE*THUMB_PAGE - 1) / (THUMB_PAGE*THUMB_PAGE);
+        uint16_t *ns = (uint16_t*)realloc(rd.th.size, sizeof(uint16_t) * v->ws_count);
+        SDL_Texture **npg = ns ? (SDL_Texture**)realloc(rd.th.pages, sizeof(SDL_Texture*) * np) : NULL;
+        if (ns) rd.th.size = ns;
+        if (npg) {
+            memset(rd.th.size + rd.th.count, 0, sizeof(uint16_t) * (v->ws_count - rd.th.count));
+            memset(npg + rd.th.npages, 0, sizeof(SDL_Texture*) * (np - rd.th.npages));
+            rd.th.pages = npg;
+            rd.th.npages = np;
+            rd.th.count = v->ws_count;
+        }
+    }
+    for (int i=0;i<rd.th.npending;i++){
+        int e = rd.th.pending[i].e, p = e / (THUMB_PAGE*THUMB_PAGE), slot = e % (THUMB_PAGE*THUMB_PAGE);
+        if (e < rd.th.count && !rd.th.pages[p]) {
+            rd.th.pages[p] = SDL_CreateTexture(ren, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STATIC,
+                                               THUMB_PAGE*THUMB_SIZE, THUMB_PAGE*THUMB_SIZE);
+            if (!rd.th.pages[p]) fprintf(stderr, "thumbnail atlas failed: %s\n", SDL_GetError());
+        }
+        if (e < rd.th.count && rd.th.pages[p]) {
+            SDL_Rect r = { (slot % THUMB_PAGE) * THUMB_SIZE, (slot / THUMB_PAGE) * THUMB_SIZE, rd.th.pending[i].w, rd.th.pending[i].h };
+            if (SDL_UpdateTexture(rd.th.pages[p], &r, rd.th.pending[i].px, r.w * 4) == 0)
+                rd.th.size[e] = (uint16_t)(r.w << 8 | r.h);
+        }
+        free(rd.th.pending[i].px);
+    }
+    rd.th.npending = 0;
+}
+
+static void draw_browser(SDL_Renderer *ren) {
+    const ViewState *v = &rd.v;
+    thumbs_upload(ren);
+    int first = v->browser_top * browser_cols(v);
+    int last = first + browser_rows(v) * browser_cols(v);
+    if (last > v->ws_count) last = v->ws_count;
+    for (int e=first; e<last; e++){
+        SDL_Rect cell = browser_cell(v, e);
+        int sz = e < rd.th.count ? rd.th.size[e] : 0;
+        if (sz) {
+            int w = sz >> 8, h = sz & 0xFF, slot = e % (THUMB_PAGE*THUMB_PAGE);
+            SDL_Rect src = { (slot % THUMB_PAGE) * THUMB_SIZE, (slot / THUMB_PAGE) * THUMB_SIZE, w, h };
+            SDL_Rect dst = { cell.x + (THUMB_SIZE - w)/2, cell.y + (THUMB_SIZE - h)/2, w, h };
+            SDL_RenderCopy(ren, rd.th.pages[e / (THUMB_PAGE*THUMB_PAGE)], &src, &dst);
+        } else {
+            SDL_SetRenderDrawColor(ren, 200, 200, 200, 255);
+            SDL_RenderFillRect(ren, &cell);
+        }
+        SDL_Rect out = { cell.x - 2, cell.y - 2, cell.w + 4, cell.h + 4 };
+        if (e == v->ws_current) SDL_SetRenderDrawColor(ren, 255, 0, 0, 255);
+        else SDL_SetRenderDrawColor(ren, 120, 120, 120, 255);
+        SDL_RenderDrawRect(ren, &out);
+    }
+}
+
+/* Actual-size preview: a second window showing the canvas at preview_scale
+   pixels per cell. It has its own renderer, so it keeps its own texture, but
+   that texture is fed by the same cell regions as the pyramid and only their
+   union is converted and uploaded before each preview frame. While the
+   window is closed the regions just accumulate. */
+#define PREVIEW_SCALE_MAX 2
+static SDL_Window *preview_win = NULL;
+static int preview_scale = 0;
+
+static void preview_touch(Box b) {
+    box_add(&rd.pv.stale, &rd.pv.has_stale, b);
+}
+
+static void draw_preview(SDL_Renderer *ren) {
+    const ViewState *v = &rd.v;
+    if (!rd.cells) return;
+    if (!rd.pv.tex) {
+        rd.pv.tex = SDL_CreateTexture(ren, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, v->cells_x, v->cells_y);
+        if (!rd.pv.tex) { fprintf(stderr, "preview texture failed: %s\n", SDL_GetError()); return; }
+        Box all = { 0, 0, v->cells_x - 1, v->cells_y - 1 };
+        rd.pv.stale = all;
+        rd.pv.has_stale = 1;
+    }
+    /* always opaque: the reference image is a tracing aid for the main view only */
+    if (rd.pv.has_stale && upload_cells(rd.pv.tex, rd.pv.stale, 0, 0, rd.v.palette_argb) == 0) rd.pv.has_stale = 0;
+    SDL_SetRenderDrawColor(ren, 220, 220, 220, 255);
+    SDL_RenderClear(ren);
+    SDL_Rect dst = { 0, 0, v->cells_x * v->preview_scale, v->cells_y * v->preview_scale };
+    SDL_RenderCopy(ren, rd.pv.tex, NULL, &dst);
+    SDL_RenderPresent(ren);
+}
+
+/* Job system shared by whole-canvas operations: a fixed pool of worker
+   threads, each with its own deque. A thread pops the newest job from the
+   back of its own deque and, when that is empty, steals the oldest job from
+   the front of another, so bands that run long are balanced by the others
+   taking the rest. A job can depend on other jobs and is only queued once its
+   last dependency has finished. The submitting thread owns queue 0 and runs
+   jobs itself while it waits. Background jobs (thumbnails) go to a queue of
+   their own that only workers take from, and only when no other job is
+   left, so they never hold up a wait or the bands it is waiting for. */
+#define MAX_WORKERS 64
+#define JOB_QUEUE_CAP 256
+#define JOB_MAX_DEPENDENTS 8
+typedef void (*RowBandFn)(void *ctx, int y0, int y1);
+
+typedef struct Job {
+    RowBandFn fn;
+    void *ctx;
+    int y0, y1;
+    SDL_atomic_t pending;  /* unfinished dependencies, plus one until submitted */
+    SDL_atomic_t done;
+    SDL_SpinLock lock;     /* guards finished and dependents */
+    int finished;
+    struct Job *dependents[JOB_MAX_DEPENDENTS];
+    int ndependents;
+} Job;
+
+typedef struct {
+    SDL_SpinLock lock;
+    Job *items[JOB_QUEUE_CAP];
+    int head, tail;        /* queued jobs are items[head..tail-1], modulo the capacity */
+} JobQueue;
+
+static struct {
+    int threads;           /* including the submitting thread; 0 or 1 runs everything inline */
+    SDL_Thread *workers[MAX_WORKERS];
+    JobQueue queues[MAX_WORKERS];
+    JobQueue background;
+    SDL_atomic_t queued;
+    SDL_mutex *idle_lock;
+    SDL_cond *idle_cond;
+    int quit;
+} jobs;
+
+static int queue_push(JobQueue *q, Job *job) {
+    int ok = 0;
+    SDL_AtomicLock(&q->lock);
+    if (q->tail - q->head < JOB_QUEUE_CAP) {
+        q->items[q->tail++ % JOB_QUEUE_CAP] = job;
+        ok = 1;
+    }
+    SDL_AtomicUnlock(&q->lock);
+    return ok;
+}
+
+/* Owner pops from the back (newest), thieves take from the front (oldest) */
+static Job *queue_pop(JobQueue *q, int steal) {
+    Job *job = NULL;
+    SDL_AtomicLock(&q->lock);
+    if (q->tail > q->head) {
+        job = steal ? q->items[q->head++ % JOB_QUEUE_CAP] : q->items[--q->tail % JOB_QUEUE_CAP];
+        if (q->head == q->tail) q->head = q->tail = 0;
+    }
+    SDL_AtomicUnlock(&q->lock);
+    return job;
+}
+
+static void job_run(Job *job, int self);
+
+static void job_enqueue(Job *job, JobQueue *q, int self) {
+    /* single-threaded, or the deque is full: run it right here */
+    if (jobs.threads <= 1 || !queue_push(q, job)) { job_run(job, self); return; }
+    SDL_AtomicIncRef(&jobs.queued);
+    SDL_LockMutex(jobs.idle_lock);
+    SDL_CondSignal(jobs.idle_cond);
+    SDL_UnlockMutex(jobs.idle_lock);
+}
+
+static void job_run(Job *job, int self) {
+    job->fn(job->ctx, job->y0, job->y1);
+    SDL_AtomicLock(&job->lock);
+    job->finished = 1;
+    int n = job->ndependents;
+    SDL_AtomicUnlock(&job->lock);
+    for (int i=0;i<n;i++){
+        Job *d = job->dependents[i];
+        if (SDL_AtomicDecRef(&d->pending)) job_enqueue(d, &jobs.queues[self], self);
+    }
+    /* last touch: once done is set the owner may free the job */
+    SDL_AtomicSet(&job->done, 1);
+}
+
+static Job *job_take(int self) {
+    Job *job = queue_pop(&jobs.queues[self], 0);
+    for (int i=1;!job && i<jobs.threads;i++) job = queue_pop(&jobs.queues[(self + i) % jobs.threads], 1);
+    if (!job && self != 0) job = queue_pop(&jobs.background, 1);
+    if (job) SDL_AtomicAdd(&jobs.queued, -1);
+    return job;
+}
+
+static int job_worker(void *p) {
+    int self = (int)(intptr_t)p;
+    for (;;) {
+        Job *job = job_take(self);
+        if (job) { job_run(job, self); continue; }
+        SDL_LockMutex(jobs.idle_lock);
+        while (!jobs.quit && SDL_AtomicGet(&jobs.queued) <= 0) SDL_CondWait(jobs.idle_cond, jobs.idle_lock);
+        int quit = jobs.quit;
+        SDL_UnlockMutex(jobs.idle_lock);
+        if (quit) return 0;
+    }
+}
+
+/* Start the pool with n threads in total (n < 1: one per CPU) */
+static void jobs_init(int n) {
+    if (n < 1) n = SDL_GetCPUCount();
+    if (n > MAX_WORKERS) n = MAX_WORKERS;
+    jobs.quit = 0;
+    SDL_AtomicSet(&jobs.queued, 0);
+    jobs.threads = 1;
+    if (n == 1) return;
+    jobs.idle_lock = SDL_CreateMutex();
+    jobs.idle_cond = SDL_CreateCond();
+    if (!jobs.idle_lock || !jobs.idle_cond) {
+        fprintf(stderr, "Job system disabled: %s\n", SDL_GetError());
+        return;
+    }
+    jobs.threads = n;
+    int started = 0;
+    for (int i=1;i<n;i++){
+        jobs.workers[i] = SDL_CreateThread(job_worker, "worker", (void*)(intptr_t)i);
+        /* a missing worker only leaves its (never used) deque without an owner */
+        if (!jobs.workers[i]) fprintf(stderr, "SDL_CreateThread failed: %s\n", SDL_GetError());
+        else started++;
+    }
+    /* background jobs need a worker to run them; without any, run everything inline */
+    if (!started) jobs.threads = 1;
+}
+
+static void jobs_shutdown() {
+    if (jobs.idle_lock) {
+        SDL_LockMutex(jobs.idle_lock);
+        jobs.quit = 1;
+        SDL_CondBroadcast(jobs.idle_cond);
+        SDL_UnlockMutex(jobs.idle_lock);
+    }
+    for (int i=1;i<jobs.threads;i++) if (jobs.workers[i]) SDL_WaitThread(jobs.workers[i], NULL);
+    memset(jobs.workers, 0, sizeof(jobs.workers));
+    if (jobs.idle_cond) SDL_DestroyCond(jobs.idle_cond);
+    if (jobs.idle_lock) SDL_DestroyMutex(jobs.idle_lock);
+    jobs.idle_cond = NULL; jobs.idle_lock = NULL;
+    jobs.threads = 1;
+}
+
+/* A job starts held: add dependencies, then job_submit releases it */
+static void job_init(Job *job, RowBandFn fn, void *ctx, int y0, int y1) {
+    memset(job, 0, sizeof(*job));
+    job->fn = fn; job->ctx = ctx; job->y0 = y0; job->y1 = y1;
+    SDL_AtomicSet(&job->pending, 1);
+}
+
+/* Hold job until dep has finished; -1 if dep already has JOB_MAX_DEPENDENTS */
+static int job_depends(Job *job, Job *dep) {
+    int r = 0;
+    SDL_AtomicLock(&dep->lock);
+    if (dep->finished) r = 0;
+    else if (dep->ndependents < JOB_MAX_DEPENDENTS) {
+        SDL_AtomicIncRef(&job->pending);
+        dep->dependents[dep->ndependents++] = job;
+    } else r = -1;
+    SDL_AtomicUnlock(&dep->lock);
+    return r;
+}
+
+static void job_submit(Job *job) {
+    if (SDL_AtomicDecRef(&job->pending)) job_enqueue(job, &jobs.queues[0], 0);
+}
+
+static void job_submit_background(Job *job) {
+    if (SDL_AtomicDecRef(&job->pending)) job_enqueue(job, &jobs.background, 0);
+}
+
+/* Wait for a submitted job, running queued jobs in the meantime */
+static void job_wait(Job *job) {
+    while (!SDL_AtomicGet(&job->done)) {
+        Job *other = job_take(0);
+        if (other) job_run(other, 0);
+        else SDL_Delay(1);
+    }
+}
+
+/* Parallel-for over rows 0..rows-1. A few bands per thread, so stealing can
+   even out bands that take longer than others. */
+static void parallel_rows(RowBandFn fn, void *ctx, int rows) {
+    int n = jobs.threads * 4;
+    if (n > JOB_QUEUE_CAP) n = JOB_QUEUE_CAP;
+    if (n > rows) n = rows;
+    Job *band = (jobs.threads > 1 && n > 1) ? (Job*)malloc(sizeof(Job) * n) : NULL;
+    if (!band) { fn(ctx, 0, rows); return; }
+    for (int i=0;i<n;i++){
+        job_init(&band[i], fn, ctx, (int)((long)rows * i / n), (int)((long)rows * (i+1) / n));
+        job_submit(&band[i]);
+    }
+    for (int i=0;i<n;i++) job_wait(&band[i]);
+    free(band);
+}
+
+/* Pixel-art upscaling filters for export. They work on the palette index
+   plane, so the result stays in the palette and neighbour tests are plain
+   index compares. (EPX is the same algorithm as Scale2x.) */
+enum { FILTER_NONE = 0, FILTER_SCALE2X, FILTER_SCALE3X, FILTER_XBR2X, FILTER_COUNT };
+static const char *filter_names[FILTER_COUNT] = { "none", "scale2x", "scale3x", "xbr2x" };
+static const int filter_factor[FILTER_COUNT] = { 1, 2, 3, 2 };
+static int export_filter = FILTER_NONE;
+
+typedef struct {
+    const uint8_t *src;
+    int w, h;
+    uint8_t *dst; /* (w*f) x (h*f) */
+    int filter;
+    int dist[PALETTE_COUNT][PALETTE_COUNT]; /* xBR color distance between palette entries */
+} FilterJob;
+
+static void scale2x_rows(FilterJob *j, int y0, int y1) {
+    int w = j->w, h = j->h, ow = w*2;
+    for (int y=y0;y<y1;y++){
+        const uint8_t *up = j->src + (size_t)(y > 0 ? y-1 : y)*w;
+        const uint8_t *row = j->src + (size_t)y*w;
+        const uint8_t *dn = j->src + (size_t)(y < h-1 ? y+1 : y)*w;
+        uint8_t *o0 = j->dst + (size_t)(2*y)*ow, *o1 = o0 + ow;
+        for (int x=0;x<w;x++){
+            uint8_t B = up[x], H = dn[x], E = row[x];
+            uint8_t D = row[x > 0 ? x-1 : x], F = row[x < w-1 ? x+1 : x];
+            uint8_t e0 = E, e1 = E, e2 = E, e3 = E;
+            if (B != H && D != F) {
+                if (D == B) e0 = D;
+                if (B == F) e1 = F;
+                if (D == H) e2 = D;
+                if (H == F) e3 = F;
+            }
+            o0[2*x] = e0; o0[2*x+1] = e1;
+            o1[2*x] = e2; o1[2*x+1] = e3;
+        }
+    }
+}
+
+static void scale3x_rows(FilterJob *j, int y0, int y1) {
+    int w = j->w, h = j->h, ow = w*3;
+    for (int y=y0;y<y1;y++){
+        const uint8_t *up = j->src + (size_t)(y > 0 ? y-1 : y)*w;
+        const uint8_t *row = j->src + (size_t)y*w;
+        const uint8_t *dn = j->src + (size_t)(y < h-1 ? y+1 : y)*w;
+        uint8_t *o0 = j->dst + (size_t)(3*y)*ow, *o1 = o0 + ow, *o2 = o1 + ow;
+        for (int x=0;x<w;x++){
+            int xl = x > 0 ? x-1 : x, xr = x < w-1 ? x+1 : x;
+            uint8_t A = up[xl], B = up[x], C = up[xr];
+            uint8_t D = row[xl], E = row[x], F = row[xr];
+            uint8_t G = dn[xl], H = dn[x], I = dn[xr];
+            uint8_t e[9] = { E, E, E, E, E, E, E, E, E };
+            if (B != H && D != F) {
+                if (D == B) e[0] = D;
+                if ((D == B && E != C) || (B == F && E != A)) e[1] = B;
+                if (B == F) e[2] = F;
+                if ((D == B && E != G) || (D == H && E != A)) e[3] = D;
+                if ((B == F && E != I) || (H == F && E != C)) e[5] = F;
+                if (D == H) e[6] = D;
+                if ((D == H && E != I) || (H == F && E != G)) e[7] = H;
+                if (H == F) e[8] = F;
+            }
+            memcpy(o0 + 3*x, e, 3);
+            memcpy(o1 + 3*x, e + 3, 3);
+            memcpy(o2 + 3*x, e + 6, 3);
+        }
+    }
+}
+
+/* xBR level 1 at 2x, no blending: a corner takes the color of the closer of
+   its two edge neighbours when the edge along that corner's diagonal is
+   weaker than across it. Each corner reuses the bottom-right rule with the
+   neighbourhood mirrored by (sx,sy). */
+#define PX(u,v) j->src[(size_t)(y + (v)*sy < 0 ? 0 : y + (v)*sy >= h ? h-1 : y + (v)*sy)*w + \
+                       (x + (u)*sx < 0 ? 0 : x + (u)*sx >= w ? w-1 : x + (u)*sx)]
+static void xbr2x_rows(FilterJob *j, int y0, int y1) {
+    int w = j->w, h = j->h, ow = w*2;
+    for (int y=y0;y<y1;y++){
+        for (int x=0;x<w;x++){
+            uint8_t E = j->src[(size_t)y*w + x];
+            for (int c=0;c<4;c++){
+                int sx = (c & 1) ? 1 : -1, sy = (c & 2) ? 1 : -1;
+                uint8_t F = PX(1,0), H = PX(0,1), out = E;
+                if (E != F && E != H) {
+                    uint8_t I = PX(1,1), G = PX(-1,1), C = PX(1,-1), D = PX(-1,0), B = PX(0,-1);
+                    uint8_t F4 = PX(2,0), I4 = PX(2,1), H5 = PX(0,2), I5 = PX(1,2);
+                    int wd1 = j->dist[E][C] + j->dist[E][G] + j->dist[I][F4] + j->dist[I][H5] + 4*j->dist[H][F];
+                    int wd2 = j->dist[H][D] + j->dist[H][I5] + j->dist[F][I4] + j->dist[F][B] + 4*j->dist[E][I];
+                    if (wd1 < wd2) out = j->dist[E][F] <= j->dist[E][H] ? F : H;
+                }
+                j->dst[(size_t)(2*y + (c >> 1))*ow + 2*x + (c & 1)] = out;
+            }
+        }
+    }
+}
+#undef PX
+
+static void filter_band(void *ctx, int y0, int y1) {
+    FilterJob *j = (FilterJob*)ctx;
+    if (j->filter == FILTER_SCALE2X) scale2x_rows(j, y0, y1);
+    else if (j->filter == FILTER_SCALE3X) scale3x_rows(j, y0, y1);
+    else if (j->filter == FILTER_XBR2X) xbr2x_rows(j, y0, y1);
+}
+
+/* Set up a filter pass over a w x h index plane; source rows are filtered
+   with filter_band into dst, which holds (w*f) x (h*f) cells */
+static FilterJob *filter_job_new(int filter, const uint8_t *src, int w, int h, uint8_t *dst) {
+    FilterJob *j = (FilterJob*)malloc(sizeof(FilterJob));
+    if (!j) return NULL;
+    j->src = src; j->w = w; j->h = h; j->dst = dst; j->filter = filter;
+    if (filter == FILTER_XBR2X) {
+        /* YUV-weighted distance as in the reference xBR */
+        for (int a=0;a<PALETTE_COUNT;a++) for (int b=0;b<PALETTE_COUNT;b++){
+            int dr = palette[a].r - palette[b].r, dg = palette[a].g - palette[b].g, db = palette[a].b - palette[b].b;
+            double yy = 0.299*dr + 0.587*dg + 0.114*db;
+            double u = -0.169*dr - 0.331*dg + 0.5*db;
+            double v = 0.5*dr - 0.419*dg - 0.081*db;
+            j->dist[a][b] = (int)(48*fabs(yy) + 7*fabs(u) + 6*fabs(v));
+        }
+    }
+    return j;
+}
+
+/* Upscale a w x h index plane into a newly allocated (w*f) x (h*f) plane */
+static uint8_t *apply_filter(int filter, const uint8_t *src, int w, int h) {
+    int f = filter_factor[filter];
+    uint8_t *dst = (uint8_t*)malloc((size_t)w * f * h * f);
+    FilterJob *j = dst ? filter_job_new(filter, src, w, h, dst) : NULL;
+    if (!j) { free(dst); return NULL; }
+    if (filter == FILTER_NONE) memcpy(dst, src, (size_t)w * h);
+    else parallel_rows(filter_band, j, h);
+    free(j);
+    return dst;
+}
+
+/* Time each filter on the current canvas size and print throughput */
+static void run_filter_benchmark() {
+    int w = CELLS_X, h = CELLS_Y;
+    uint8_t *src = (uint8_t*)malloc((size_t)w * h);
+    if (!src) { fprintf(stderr, "Failed to allocate benchmark canvas\n"); return; }
+    /* blocky random art so the filters see both flat areas and edges */
+    srand(1234);
+    for (int y=0;y<h;y++) for (int x=0;x<w;x++) src[(size_t)y*w + x] = (uint8_t)(((x/3) * 7 + (y/2) * 13 + (rand() % 16 == 0)) % PALETTE_COUNT);
+    printf("Filter benchmark on %dx%d cells, %d CPUs\n", w, h, SDL_GetCPUCount());
+    for (int f=FILTER_SCALE2X; f<FILTER_COUNT; f++){
+        int iters = 0;
+        Uint64 start = SDL_GetPerformanceCounter(), elapsed;
+        do {
+            free(apply_filter(f, src, w, h));
+            iters++;
+            elapsed = SDL_GetPerformanceCounter() - start;
+        } while (elapsed < SDL_GetPerformanceFrequency() / 2 || iters < 3);
+        double secs = (double)elapsed / SDL_GetPerformanceFrequency() / iters;
+        double fo = filter_factor[f];
+        printf("  %-8s %8.1f MPixel/s in, %8.1f MPixel/s out\n", filter_names[f],
+               w * (double)h / secs / 1e6, w * (double)h * fo * fo / secs / 1e6);
+    }
+    free(src);
+}
+
+/* RotSprite-style rotation of the selection: the selection is upscaled 8x
+   with Scale2x three times once, then for every angle each output cell takes
+   the nearest sample of the rotated 8x image at its center. Edges stay crisp
+   because the upscale has already smoothed the stair steps. The result is
+   previewed in a texture while dragging and written on release. */
+#define ROT_UPSCALE 8
+#define ROT_TILE 32
+#define ROT_SNAP (3.14159265358979323846 / 12) /* Shift: 15 degree steps */
+static struct {
+    int active, dragging;
+    int x, y, w, h;            /* source selection */
+    uint8_t *big;              /* (w*8) x (h*8), index 0 transparent */
+    double angle, grab_angle;  /* radians; grab_angle: pointer angle at drag start */
+    int ox, oy, ow, oh;        /* rotated result: canvas position and size */
+    uint8_t *out;
+    size_t out_cap;
+} rot;
+static int rot_version = 0; /* bumped whenever out changes */
+
+static void rotate_band(void *ctx, int ty0, int ty1) {
+    (void)ctx;
+    double c = cos(rot.angle), s = sin(rot.angle);
+    double cx = rot.x + rot.w * 0.5, cy = rot.y + rot.h * 0.5;
+    int bw = rot.w * ROT_UPSCALE, bh = rot.h * ROT_UPSCALE;
+    for (int ty=ty0; ty<ty1; ty++){
+        int y0 = ty * ROT_TILE, y1 = y0 + ROT_TILE < rot.oh ? y0 + ROT_TILE : rot.oh;
+        for (int x0=0; x0<rot.ow; x0+=ROT_TILE){
+            int x1 = x0 + ROT_TILE < rot.ow ? x0 + ROT_TILE : rot.ow;
+            for (int y=y0; y<y1; y++){
+                /* inverse-rotate the first cell center of the row, then step along it */
+                double px = rot.ox + x0 + 0.5 - cx, py = rot.oy + y + 0.5 - cy;
+                double u = (c*px + s*py + rot.w * 0.5) * ROT_UPSCALE;
+                double v = (-s*px + c*py + rot.h * 0.5) * ROT_UPSCALE;
+                double du = c * ROT_UPSCALE, dv = -s * ROT_UPSCALE;
+                uint8_t *dst = rot.out + (size_t)y * rot.ow;
+                for (int x=x0; x<x1; x++, u += du, v += dv){
+                    int bu = (int)floor(u), bv = (int)floor(v);
+                    dst[x] = (bu >= 0 && bu < bw && bv >= 0 && bv < bh) ? rot.big[(size_t)bv*bw + bu] : 0;
+                }
+            }
+        }
+    }
+}
+
+/* Recompute the rotated cells for rot.angle */
+static int rotate_update() {
+    double c = fabs(cos(rot.angle)), s = fabs(sin(rot.angle));
+    double cx = rot.x + rot.w * 0.5, cy = rot.y + rot.h * 0.5;
+    double hw = (c*rot.w + s*rot.h) * 0.5, hh = (s*rot.w + c*rot.h) * 0.5;
+    rot.ox = (int)floor(cx - hw + 1e-6);
+    rot.oy = (int)floor(cy - hh + 1e-6);
+    rot.ow = (int)ceil(cx + hw - 1e-6) - rot.ox;
+    rot.oh = (int)ceil(cy + hh - 1e-6) - rot.oy;
+    size_t need = (size_t)rot.ow * rot.oh;
+    if (need > rot.out_cap) {
+        uint8_t *o = (uint8_t*)realloc(rot.out, need);
+        if (!o) return -1;
+        rot.out = o;
+        rot.out_cap = need;
+    }
+    parallel_rows(rotate_band, NULL, (rot.oh + ROT_TILE - 1) / ROT_TILE);
+    rot_version++;
+    return 0;
+}
+
+static void rotate_end() {
+    free(rot.big);
+    free(rot.out);
+    memset(&rot, 0, sizeof(rot));
+}
+
+/* Lift the selection and build its 8x upscale */
+static int rotate_begin() {
+    if (!sel_active) return -1;
+    rotate_end();
+    rot.x = sel_x0; rot.y = sel_y0;
+    rot.w = sel_x1 - sel_x0 + 1; rot.h = sel_y1 - sel_y0 + 1;
+    uint8_t *cells = (uint8_t*)malloc((size_t)rot.w * rot.h);
+    if (!cells) return -1;
+    for (int y=0;y<rot.h;y++) memcpy(cells + (size_t)y*rot.w, canvas + (size_t)(rot.y + y)*CELLS_X + rot.x, rot.w);
+    uint8_t *big = cells;
+    for (int f=1; f<ROT_UPSCALE; f*=2){
+        uint8_t *next = apply_filter(FILTER_SCALE2X, big, rot.w*f, rot.h*f);
+        free(big);
+        if (!next) return -1;
+        big = next;
+    }
+    rot.big = big;
+    rot.active = 1;
+    return rotate_update();
+}
+
+/* Write the rotated selection: the source area is cleared, then the opaque
+   rotated cells are pasted. One undo step; the selection follows the result. */
+static void rotate_commit() {
+    edit_begin();
+    for (int y=0;y<rot.h;y++) fill_row_span(rot.y + y, rot.x, rot.x + rot.w - 1, 0);
+    mark_dirty(rot.x, rot.y, rot.x + rot.w - 1, rot.y + rot.h - 1);
+    int x0 = rot.ox < 0 ? 0 : rot.ox;
+    int x1 = rot.ox + rot.ow > CELLS_X ? CELLS_X - 1 : rot.ox + rot.ow - 1;
+    for (int j=0;j<rot.oh;j++){
+        int y = rot.oy + j;
+        if (y < 0 || y >= CELLS_Y || x0 > x1) continue;
+        if (edit_touch(x0, y, x1, y) != 0) break;
+        const uint8_t *src = rot.out + (size_t)j * rot.ow - rot.ox;
+        uint8_t *dst = canvas + (size_t)y*CELLS_X;
+        for (int x=x0;x<=x1;x++) if (src[x]) dst[x] = src[x];
+    }
+    edit_end();
+    set_selection(rot.ox, rot.oy, rot.ox + rot.ow - 1, rot.oy + rot.oh - 1);
+    if (sel_active) mark_dirty(sel_x0, sel_y0, sel_x1, sel_y1);
+    rotate_end();
+}
+
+/* Pointer angle around the selection center, in window pixels */
+static double rotate_pointer_angle(int mx, int my) {
+    ViewState v = current_view();
+    double cs = view_cell_size(&v);
+    double cx = view_origin_x(&v) + (rot.x + rot.w * 0.5) * cs, cy = view_origin_y(&v) + (rot.y + rot.h * 0.5) * cs;
+    return atan2(my - cy, mx - cx);
+}
+
+/* Preview: hide the lifted source and draw the rotated cells from a texture
+   sized for the largest possible result, so dragging never reallocates it */
+static void draw_rotate_preview(SDL_Renderer *ren) {
+    const ViewState *v = &rd.v;
+    if (!v->rot_active || !rd.rot_out) return;
+    int need = (int)ceil(sqrt((double)v->rot_w*v->rot_w + (double)v->rot_h*v->rot_h)) + 2;
+    if (!rd.rot_tex || rd.rot_tex_size < need) {
+        if (rd.rot_tex) SDL_DestroyTexture(rd.rot_tex);
+        rd.rot_tex = SDL_CreateTexture(ren, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, need, need);
+        if (!rd.rot_tex) return;
+        SDL_SetTextureBlendMode(rd.rot_tex, SDL_BLENDMODE_BLEND);
+        rd.rot_tex_size = need;
+    }
+    SDL_Rect src = { 0, 0, rd.rot_ow < rd.rot_tex_size ? rd.rot_ow : rd.rot_tex_size, rd.rot_oh < rd.rot_tex_size ? rd.rot_oh : rd.rot_tex_size };
+    void *pixels; int pitch;
+    if (SDL_LockTexture(rd.rot_tex, &src, &pixels, &pitch) == 0) {
+        for (int y=0;y<src.h;y++){
+            const uint8_t *s = rd.rot_out + (size_t)y * rd.rot_ow;
+            uint32_t *d = (uint32_t*)((uint8_t*)pixels + (size_t)y*pitch);
+            for (int x=0;x<src.w;x++) d[x] = s[x] ? rd.v.palette_argb[s[x]] : 0;
+        }
+        SDL_UnlockTexture(rd.rot_tex);
+    }
+    SDL_Color bg = rd.v.palette[0];
+    SDL_Rect hole = view_rect(v, v->rot_x, v->rot_y, v->rot_w, v->rot_h);
+    SDL_SetRenderDrawColor(ren, bg.r, bg.g, bg.b, bg.a);
+    SDL_RenderFillRect(ren, &hole);
+    SDL_Rect dst = view_rect(v, rd.rot_ox, rd.rot_oy, src.w, src.h);
+    SDL_RenderCopy(ren, rd.rot_tex, &src, &dst);
+}
+
+static ViewState current_view() {
+    ViewState v;
+    v.cells_x = CELLS_X; v.cells_y = CELLS_Y; v.tile_mode = tile_mode;
+    v.zoom = zoom; v.pan_x = pan_x; v.pan_y = pan_y; v.view_w = view_w; v.view_h = view_h;
+    v.show_grid = show_grid; v.symmetry = symmetry;
+    v.current_color = current_color; v.secondary_color = secondary_color;
+    v.ref_mode = ref_mode; v.bg_clear = ref_loaded && ref_mode == REF_UNDER;
+    v.sel_active = sel_active; v.sel_x0 = sel_x0; v.sel_y0 = sel_y0; v.sel_x1 = sel_x1; v.sel_y1 = sel_y1;
+    v.shape_active = shape_active; v.shape_color = shape_color;
+    v.rot_active = rot.active; v.rot_x = rot.x; v.rot_y = rot.y; v.rot_w = rot.w; v.rot_h = rot.h;
+    v.preview_scale = render_sparse() ? 0 : preview_scale; /* the renderer lacks the cells out of view */
+    memcpy(v.palette, palette, sizeof(palette));
+    memcpy(v.palette_argb, palette_argb, sizeof(palette_argb));
+    v.browser = browser; v.browser_top = browser_top;
+    v.ws_count = ws.count; v.ws_current = docs[doc_cur].ws_entry;
+    return v;
+}
+
+/* Render thread. The input thread handles events and edits the document;
+   whenever the renderer has picked up the previous frame it publishes the
+   next one as a batch of commands: the view state, overlays that changed,
+   the dirty cell regions (copied, so the renderer never reads the live
+   canvas; on a large canvas only those in view, see rcopy), the changed
+   navigator texels and a present marker. Commands travel through a single-producer
+   single-consumer ring in which the producer only advances tail and the
+   consumer only head, so neither side waits for the other and input is
+   never held up by vsync. With --no-render-thread the main thread drains the
+   same queue itself right after publishing. */
+enum { RCMD_STATE, RCMD_CELLS, RCMD_NAV, RCMD_SHAPE, RCMD_ROTATE, RCMD_REFERENCE, RCMD_THUMB, RCMD_PRESENT, RCMD_QUIT };
+typedef struct {
+    int type;
+    ViewState view;      /* RCMD_STATE */
+    Box box;             /* RCMD_CELLS: region held in data; RCMD_NAV: navigator texels held in data */
+    void *data;          /* cells, texels, spans, rotated cells, reference surface or thumbnail; the consumer frees it */
+    int count;           /* RCMD_SHAPE: number of spans; RCMD_THUMB: workspace entry */
+    int ox, oy, ow, oh;  /* RCMD_ROTATE: placement of the rotated cells; RCMD_THUMB: ow x oh pixels;
+                            RCMD_NAV: ow x oh navigator */
+} RenderCmd;
+#define RCMD_CAP 64
+#define THUMBS_PER_FRAME 16
+#define CELLS_PER_FRAME ((size_t)16 << 20) /* a huge canvas reaches the renderer in bands over several frames */
+#define FETCH_PER_FRAME 8 /* runs of blocks scrolled into view sent per frame (large canvases) */
+#define RCMD_PER_FRAME (DIRTY_MAX + 6 + FETCH_PER_FRAME + THUMBS_PER_FRAME)
+static struct {
+    RenderCmd items[RCMD_CAP];
+    SDL_atomic_t head, tail;
+    SDL_atomic_t frames;  /* published frames the renderer has not taken yet */
+    SDL_sem *wake;        /* posted per published frame */
+    SDL_sem *ready;       /* render thread has created (or failed to create) its renderer */
+    SDL_Renderer *ren;
+    SDL_Renderer *pren;   /* preview window's renderer */
+} rq;
+static int sent_shape_version = -1, sent_rot_version = -1, sent_bg_clear = 0;
+
+static int rq_space() {
+    return RCMD_CAP - (int)((unsigned)SDL_AtomicGet(&rq.tail) - (unsigned)SDL_AtomicGet(&rq.head));
+}
+
+/* Producer side: write the slot, then publish it by advancing tail */
+static int rq_push(const RenderCmd *c) {
+    unsigned tail = (unsigned)SDL_AtomicGet(&rq.tail);
+    if (rq_space() <= 0) return -1;
+    rq.items[tail % RCMD_CAP] = *c;
+    SDL_AtomicSet(&rq.tail, (int)(tail + 1));
+    return 0;
+}
+
+/* Consumer side: read the slot, then release it by advancing head */
+static int rq_pop(RenderCmd *c) {
+    unsigned head = (unsigned)SDL_AtomicGet(&rq.head);
+    if (head == (unsigned)SDL_AtomicGet(&rq.tail)) return 0;
+    *c = rq.items[head % RCMD_CAP];
+    SDL_AtomicSet(&rq.head, (int)(head + 1));
+    return 1;
+}
+
+static int thumbs_publish(int budget);
+
+/* Navigator source: the k x k block averages of the canvas, kept here where
+   the whole canvas is. Only blocks under changed cells are computed again;
+   a block of more than NAV_SAMPLES cells a side is averaged over an evenly
+   spaced NAV_SAMPLES x NAV_SAMPLES subset of its cells, so a change costs a
+   bounded number of reads however large the canvas (and a mapped canvas is
+   not paged in just for the navigator). */
+#define NAV_SAMPLES 8
+static struct {
+    int cells_x, cells_y, k, w, h;
+    uint32_t *px;      /* w x h */
+    uint8_t *dirty;    /* w x h, blocks with cells changed since they were sent */
+    Box bounds;        /* of the dirty blocks, x0 > x1 when there are none */
+} navs;
+
+static void navs_touch(Box b) {
+    if (!navs.dirty) return;
+    int k = navs.k;
+    Box t = { b.x0 / k, b.y0 / k, b.x1 / k, b.y1 / k };
+    for (int y=t.y0; y<=t.y1; y++) memset(navs.dirty + (size_t)y * navs.w + t.x0, 1, t.x1 - t.x0 + 1);
+    navs.bounds = navs.bounds.x0 > navs.bounds.x1 ? t : box_union(navs.bounds, t);
+}
+
+static void navs_reset() {
+    free(navs.px);
+    free(navs.dirty);
+    navs.cells_x = CELLS_X; navs.cells_y = CELLS_Y;
+    navs.k = nav_block(CELLS_X, CELLS_Y);
+    navs.w = (CELLS_X + navs.k - 1) / navs.k;
+    navs.h = (CELLS_Y + navs.k - 1) / navs.k;
+    navs.px = (uint32_t*)malloc(sizeof(uint32_t) * navs.w * navs.h);
+    navs.dirty = (uint8_t*)calloc((size_t)navs.w * navs.h, 1);
+    navs.bounds.x0 = 1; navs.bounds.x1 = 0;
+    if (!navs.px || !navs.dirty) {
+        free(navs.px); free(navs.dirty);
+        navs.px = NULL; navs.dirty = NULL;
+        return;
+    }
+    Box all = { 0, 0, CELLS_X - 1, CELLS_Y - 1 };
+    navs_touch(all);
+}
+
+/* Average the dirty blocks and send their bounding rectangle */
+static void navs_publish() {
+    if (navs.cells_x != CELLS_X || navs.cells_y != CELLS_Y) navs_reset();
+    if (!navs.px || navs.bounds.x0 > navs.bounds.x1) return;
+    Box r = navs.bounds;
+    int k = navs.k, n = k < NAV_SAMPLES ? k : NAV_SAMPLES;
+    for (int ty=r.y0; ty<=r.y1; ty++){
+        uint8_t *dirty = navs.dirty + (size_t)ty * navs.w;
+        int y0 = ty * k, bh = CELLS_Y - y0 < k ? CELLS_Y - y0 : k;
+        for (int tx=r.x0; tx<=r.x1; tx++){
+            if (!dirty[tx]) continue;
+            dirty[tx] = 0;
+            int x0 = tx * k, bw = CELLS_X - x0 < k ? CELLS_X - x0 : k;
+            int nx = bw < n ? bw : n, ny = bh < n ? bh : n;
+            unsigned cr = 0, cg = 0, cb = 0;
+            for (int j=0;j<ny;j++){
+                /* sample rows and columns at the centers of ny x nx equal parts */
+                const uint8_t *row = canvas + (size_t)(y0 + (int)((2LL*j + 1) * bh / (2*ny))) * CELLS_X + x0;
+                for (int i=0;i<nx;i++){
+                    SDL_Color c = palette[row[(2LL*i + 1) * bw / (2*nx)]];
+                    cr += c.r; cg += c.g; cb += c.b;
+                }
+            }
+            unsigned m = (unsigned)(nx * ny);
+            navs.px[(size_t)ty * navs.w + tx] = 0xFF000000u | ((cr/m) << 16) | ((cg/m) << 8) | (cb/m);
+        }
+    }
+    int rw = r.x1 - r.x0 + 1, rh = r.y1 - r.y0 + 1;
+    uint32_t *px = (uint32_t*)malloc(sizeof(uint32_t) * rw * rh);
+    if (!px) return; /* the blocks are current here; they go out with the next change */
+    for (int y=0;y<rh;y++) memcpy(px + (size_t)y * rw, navs.px + (size_t)(r.y0 + y) * navs.w + r.x0, sizeof(uint32_t) * rw);
+    RenderCmd c;
+    memset(&c, 0, sizeof(c));
+    c.type = RCMD_NAV; c.box = r; c.data = px; c.ow = navs.w; c.oh = navs.h;
+    if (rq_push(&c) != 0) { free(px); return; }
+    navs.bounds.x0 = 1; navs.bounds.x1 = 0;
+}
+
+/* What the renderer's copy of the cells holds. With --map-dir, for a canvas
+   of at least map_threshold cells (render_sparse), it only gets the RBLOCK x RBLOCK blocks
+   in view: cells changed out of view are not sent but mark their blocks as
+   out of date, and blocks that scroll into view out of date are fetched, a
+   few runs per frame. Smaller canvases are always sent whole. */
+#define RBLOCK 256
+static struct {
+    int cells_x, cells_y, bx, by;
+    uint8_t *have;     /* bx x by: the renderer's copy of the block is current */
+} rcopy;
+
+static void rcopy_reset() {
+    free(rcopy.have);
+    rcopy.cells_x = CELLS_X; rcopy.cells_y = CELLS_Y;
+    rcopy.bx = (CELLS_X + RBLOCK - 1) / RBLOCK;
+    rcopy.by = (CELLS_Y + RBLOCK - 1) / RBLOCK;
+    rcopy.have = render_sparse() ? (uint8_t*)calloc((size_t)rcopy.bx * rcopy.by, 1) : NULL;
+}
+
+/* Blocks of the canvas in view, x0 > x1 when none (the browser is shown) */
+static Box rcopy_wanted(const ViewState *v) {
+    Box w = { 1, 1, 0, 0 };
+    if (v->browser || view_area_w(v) <= 0) return w;
+    Box vis;
+    cell_from_window(v, 0, 0, &vis.x0, &vis.y0);
+    cell_from_window(v, view_area_w(v) - 1, v->view_h - 1, &vis.x1, &vis.y1);
+    /* in tile mode the view may show parts of several copies: any part of the canvas */
+    if (vis.x0 < 0 || vis.x1 >= CELLS_X) { if (v->tile_mode) { vis.x0 = 0; vis.x1 = CELLS_X - 1; } }
+    if (vis.y0 < 0 || vis.y1 >= CELLS_Y) { if (v->tile_mode) { vis.y0 = 0; vis.y1 = CELLS_Y - 1; } }
+    if (vis.x0 < 0) vis.x0 = 0;
+    if (vis.y0 < 0) vis.y0 = 0;
+    if (vis.x1 >= CELLS_X) vis.x1 = CELLS_X - 1;
+    if (vis.y1 >= CELLS_Y) vis.y1 = CELLS_Y - 1;
+    if (vis.x0 > vis.x1 || vis.y0 > vis.y1) return w;
+    Box b = { vis.x0 / RBLOCK, vis.y0 / RBLOCK, vis.x1 / RBLOCK, vis.y1 / RBLOCK };
+    return b;
+}
+
+/* Copy cells b of the canvas into an RCMD_CELLS; -1 if it could not be sent */
+static int send_cells(Box b) {
+    int w = b.x1 - b.x0 + 1, h = b.y1 - b.y0 + 1;
+    uint8_t *cells = (uint8_t*)malloc((size_t)w * h);
+    if (!cells) return -1;
+    for (int y=0;y<h;y++) memcpy(cells + (size_t)y * w, canvas + (size_t)(b.y0 + y)*CELLS_X + b.x0, w);
+    RenderCmd c;
+    memset(&c, 0, sizeof(c));
+    c.type = RCMD_CELLS; c.box = b; c.data = cells;
+    if (rq_push(&c) != 0) { free(cells); return -1; }
+    return 0;
+}
+
+/* Hand the current frame to the renderer */
+static void publish_frame() {
+    if (rq_space() < RCMD_PER_FRAME) return;
+    RenderCmd c;
+    ViewState v = current_view();
+    if (v.bg_clear != sent_bg_clear) {
+        /* index 0 changes alpha: the whole texture has to be converted again */
+        mark_all_dirty();
+        sent_bg_clear = v.bg_clear;
+    }
+    memset(&c, 0, sizeof(c));
+    c.type = RCMD_STATE; c.view = v;
+    rq_push(&c);
+    if (ref_pending_set) {
+        memset(&c, 0, sizeof(c));
+        c.type = RCMD_REFERENCE; c.data = ref_pending;
+        rq_push(&c);
+        ref_pending = NULL; ref_pending_set = 0;
+    }
+    if (v.shape_active && shape_version != sent_shape_version) {
+        memset(&c, 0, sizeof(c));
+        c.type = RCMD_SHAPE; c.count = span_count;
+        c.data = span_count ? malloc(sizeof(Span) * span_count) : NULL;
+        if (c.data || !span_count) {
+            if (span_count) memcpy(c.data, spans, sizeof(Span) * span_count);
+            rq_push(&c);
+            sent_shape_version = shape_version;
+        }
+    }
+    if (v.rot_active && rot_version != sent_rot_version) {
+        size_t n = (size_t)rot.ow * rot.oh;
+        memset(&c, 0, sizeof(c));
+        c.type = RCMD_ROTATE; c.ox = rot.ox; c.oy = rot.oy; c.ow = rot.ow; c.oh = rot.oh;
+        c.data = malloc(n ? n : 1);
+        if (c.data) {
+            memcpy(c.data, rot.out, n);
+            rq_push(&c);
+            sent_rot_version = rot_version;
+        }
+    }
+    if (rcopy.cells_x != CELLS_X || rcopy.cells_y != CELLS_Y) rcopy_reset();
+    Box want = rcopy_wanted(&v);
+    int kept = 0;
+    size_t budget = CELLS_PER_FRAME;
+    for (int i=0;i<dirty_count;i++){
+        Box b = dirty[i];
+        if (b.x0 < 0) b.x0 = 0;
+        if (b.y0 < 0) b.y0 = 0;
+        if (b.x1 >= CELLS_X) b.x1 = CELLS_X-1;
+        if (b.y1 >= CELLS_Y) b.y1 = CELLS_Y-1;
+        if (b.x0 > b.x1 || b.y0 > b.y1) continue;
+        navs_touch(b);
+        if (rcopy.have) {
+            /* blocks out of view go out of date; only the part in view is sent */
+            for (int by=b.y0/RBLOCK; by<=b.y1/RBLOCK; by++)
+                for (int bx=b.x0/RBLOCK; bx<=b.x1/RBLOCK; bx++)
+                    if (bx < want.x0 || bx > want.x1 || by < want.y0 || by > want.y1) rcopy.have[(size_t)by * rcopy.bx + bx] = 0;
+            if (want.x0 > want.x1) continue;
+            if (b.x0 < want.x0 * RBLOCK) b.x0 = want.x0 * RBLOCK;
+            if (b.y0 < want.y0 * RBLOCK) b.y0 = want.y0 * RBLOCK;
+            if (b.x1 >= (want.x1 + 1) * RBLOCK) b.x1 = (want.x1 + 1) * RBLOCK - 1;
+            if (b.y1 >= (want.y1 + 1) * RBLOCK) b.y1 = (want.y1 + 1) * RBLOCK - 1;
+            if (b.x0 > b.x1 || b.y0 > b.y1) continue;
+        }
+        int w = b.x1 - b.x0 + 1, h = b.y1 - b.y0 + 1;
+        if (budget < (size_t)w && budget < CELLS_PER_FRAME) { dirty[kept++] = b; continue; }
+        if ((size_t)w * h > budget && h > 1) {
+            /* send the top rows now (at least one), the rest stays dirty */
+            Box rest = b;
+            h = budget / w > 1 ? (int)(budget / w) : 1;
+            rest.y0 = b.y0 + h;
+            b.y1 = rest.y0 - 1;
+            dirty[kept++] = rest;
+        }
+        budget = (size_t)w * h < budget ? budget - (size_t)w * h : 0;
+        if (send_cells(b) != 0) dirty[kept++] = b; /* try again next frame */
+    }
+    dirty_count = kept;
+    /* blocks scrolled into view: whole blocks, in runs along a row */
+    for (int by=want.y0, runs=0; rcopy.have && by<=want.y1 && runs<FETCH_PER_FRAME; by++){
+        uint8_t *have = rcopy.have + (size_t)by * rcopy.bx;
+        for (int bx=want.x0; bx<=want.x1 && runs<FETCH_PER_FRAME; bx++){
+            if (have[bx]) continue;
+            int end = bx;
+            while (end < want.x1 && !have[end + 1]) end++;
+            Box b = { bx * RBLOCK, by * RBLOCK, (end + 1) * RBLOCK - 1, (by + 1) * RBLOCK - 1 };
+            if (b.x1 >= CELLS_X) b.x1 = CELLS_X - 1;
+            if (b.y1 >= CELLS_Y) b.y1 = CELLS_Y - 1;
+            size_t n = (size_t)(b.x1 - b.x0 + 1) * (b.y1 - b.y0 + 1);
+            if (n > budget && budget < CELLS_PER_FRAME) { runs = FETCH_PER_FRAME; break; }
+            if (send_cells(b) != 0) { runs = FETCH_PER_FRAME; break; }
+            budget = n < budget ? budget - n : 0;
+            memset(have + bx, 1, end - bx + 1);
+            runs++;
+            bx = end;
+        }
+    }
+    navs_publish();
+    if (v.browser) thumbs_publish(THUMBS_PER_FRAME);
+    memset(&c, 0, sizeof(c));
+    c.type = RCMD_PRESENT;
+    SDL_AtomicIncRef(&rq.frames);
+    rq_push(&c);
+    if (rq.wake) SDL_SemPost(rq.wake);
+}
+
+/* Apply every queued command; 1 if a frame is ready to draw, -1 on quit */
+static int render_drain() {
+    RenderCmd c;
+    int frame = 0;
+    while (rq_pop(&c)) {
+        switch (c.type) {
+        case RCMD_STATE:
+            rd.v = c.view;
+            if (!rd.cells || rd.lvl[0].w != rd.v.cells_x || rd.lvl[0].h != rd.v.cells_y) {
+                /* the producer sends the whole canvas (or the part in view) along with a size change */
+                render_cells_alloc((size_t)rd.v.cells_x * rd.v.cells_y);
+                if (!rd.cells) fprintf(stderr, "Failed to allocate the render copy of the canvas\n");
+                pyr_reset();
+                if (rd.pv.tex) SDL_DestroyTexture(rd.pv.tex);
+                rd.pv.tex = NULL;
+                rd.pv.has_stale = 0;
+            }
+            break;
+        case RCMD_CELLS:
+            if (rd.cells && c.box.x1 < rd.v.cells_x && c.box.y1 < rd.v.cells_y) {
+                int w = c.box.x1 - c.box.x0 + 1;
+                for (int y=c.box.y0; y<=c.box.y1; y++)
+                    memcpy(rd.cells + (size_t)y * rd.v.cells_x + c.box.x0, (uint8_t*)c.data + (size_t)(y - c.box.y0) * w, w);
+                pyr_touch(c.box);
+                preview_touch(c.box);
+            }
+            free(c.data);
+            break;
+        case RCMD_NAV:
+            nav_received(c.box, c.ow, c.oh, (uint32_t*)c.data);
+            free(c.data);
+            break;
+        case RCMD_SHAPE:
+            free(rd.spans);
+            rd.spans = (Span*)c.data; rd.span_count = c.count;
+            break;
+        case RCMD_ROTATE:
+            free(rd.rot_out);
+            rd.rot_out = (uint8_t*)c.data;
+            rd.rot_ox = c.ox; rd.rot_oy = c.oy; rd.rot_ow = c.ow; rd.rot_oh = c.oh;
+            break;
+        case RCMD_REFERENCE:
+            if (rd.ref_tex) SDL_DestroyTexture(rd.ref_tex);
+            if (rd.ref_src) SDL_FreeSurface(rd.ref_src);
+            rd.ref_src = (SDL_Surface*)c.data;
+            rd.ref_tex = NULL; rd.ref_tex_w = rd.ref_tex_h = 0;
+            break;
+        case RCMD_THUMB:
+            thumbs_received(c.count, c.ow, c.oh, (uint32_t*)c.data);
+            break;
+        case RCMD_PRESENT:
+            SDL_AtomicAdd(&rq.frames, -1);
+            frame = 1;
+            break;
+        case RCMD_QUIT:
+            return -1;
+        }
+    }
+    return frame;
+}
+
+static void render_frame(SDL_Renderer *ren, SDL_Renderer *pren) {
+    int out_w = 0, out_h = 0;
+    SDL_GetRendererOutputSize(ren, &out_w, &out_h);
+    /* everything is drawn in window points; the scale maps them to output pixels */
+    rd.dpi = rd.v.view_w > 0 && out_w > 0 ? (double)out_w / rd.v.view_w : 1.0;
+    SDL_RenderSetScale(ren, (float)rd.dpi, (float)rd.dpi);
+    int win_w = rd.v.view_w, win_h = rd.v.view_h;
+    SDL_SetRenderDrawColor(ren, 220, 220, 220, 255);
+    SDL_RenderClear(ren);
+
+    if (rd.v.browser) draw_browser(ren);
+    else {
+        draw_canvas_to_renderer(ren);
+        draw_shape_preview(ren);
+        draw_rotate_preview(ren);
+        draw_selection(ren);
+    }
+    /* the panel covers whatever part of the canvas reaches under it */
+    SDL_Rect panel = { view_area_w(&rd.v), 0, win_w - view_area_w(&rd.v), win_h };
+    SDL_SetRenderDrawColor(ren, 220, 220, 220, 255);
+    SDL_RenderFillRect(ren, &panel);
+    draw_palette_ui(ren, win_w, win_h);
+    draw_navigator(ren, win_h);
+
+    SDL_RenderPresent(ren);
+    if (pren && rd.v.preview_scale) draw_preview(pren);
+}
+
+/* The preview renderer does not wait for vsync: the main window already
+   paces the frames, and a second wait would halve the frame rate */
+static SDL_Renderer *create_preview_renderer() {
+    if (!preview_win) return NULL;
+    SDL_Renderer *pren = SDL_CreateRenderer(preview_win, -1, SDL_RENDERER_ACCELERATED);
+    if (!pren) fprintf(stderr, "Preview renderer failed: %s\n", SDL_GetError());
+    return pren;
+}
+
+static int render_thread(void *p) {
+    SDL_Renderer *ren = SDL_CreateRenderer((SDL_Window*)p, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+    rq.ren = ren;
+    if (ren) rq.pren = create_preview_renderer();
+    SDL_SemPost(rq.ready);
+    if (!ren) return -1;
+    for (;;) {
+        SDL_SemWait(rq.wake);
+        int r = render_drain();
+        if (r < 0) break;
+        if (r > 0) render_frame(ren, rq.pren);
+    }
+    render_release();
+    if (rq.pren) SDL_DestroyRenderer(rq.pren);
+    SDL_DestroyRenderer(ren);
+    return 0;
+}
+
+/* Scratch buffers for save and load. Each purpose keeps its buffer between
+   calls and only grows it, so repeated saves and loads reuse memory that is
+   already mapped instead of going through malloc/free and faulting fresh
+   pages in every time. A buffer above SCRATCH_KEEP is freed once its user
+   is done (scratch_done), so a single huge export or import does not stay
+   resident; what is kept counts towards the workspace budget. scratch_report
+   prints the high-water marks. Input thread only; thumbnail workers
+   allocate their own. */
+#define SCRATCH_KEEP ((size_t)32 << 20)
+enum { SCRATCH_PIXELS, SCRATCH_FILTER, SCRATCH_IMPORT, SCRATCH_COUNT };
+static const char *scratch_names[SCRATCH_COUNT] = { "export pixels", "export filter", "import pixels" };
+static struct {
+    void *p;
+    size_t cap;
+    size_t high;        /* largest request */
+    unsigned uses, grows;
+} scratch[SCRATCH_COUNT];
+
+/* Buffer which of at least n bytes, contents undefined; valid until the next
+   scratch_get(which, ...) */
+static void *scratch_get(int which, size_t n) {
+    scratch[which].uses++;
+    if (n > scratch[which].high) scratch[which].high = n;
+    if (n > scratch[which].cap) {
+        /* nothing to keep, so no realloc copy */
+        free(scratch[which].p);
+        scratch[which].p = malloc(n);
+        scratch[which].cap = scratch[which].p ? n : 0;
+        scratch[which].grows++;
+    }
+    return scratch[which].p;
+}
+
+/* The caller is done with buffer which until its next scratch_get */
+static void scratch_done(int which) {
+    if (scratch[which].cap <= SCRATCH_KEEP) return;
+    free(scratch[which].p);
+    scratch[which].p = NULL;
+    scratch[which].cap = 0;
+}
+
+static size_t scratch_bytes() {
+    size_t n = 0;
+    for (int i=0;i<SCRATCH_COUNT;i++) n += scratch[i].cap;
+    return n;
+}
+
+static void scratch_report() {
+    for (int i=0;i<SCRATCH_COUNT;i++){
+        if (!scratch[i].uses) continue;
+        printf("Scratch %-13s high-water %8.2f MB, %u uses, %u allocations\n", scratch_names[i],
+               scratch[i].high / 1048576.0, scratch[i].uses, scratch[i].grows);
+    }
+}
+
+static void scratch_free() {
+    for (int i=0;i<SCRATCH_COUNT;i++) free(scratch[i].p);
+    memset(scratch, 0, sizeof(scratch));
+}
+
+/* Pack a palette color for the 32-bit export surface (R,G,B,A in memory order) */
+static uint32_t pack_rgba(SDL_Color c) {
+#if SDL_BYTEORDER == SDL_BIG_ENDIAN
+    return ((uint32_t)c.r<<24) | ((uint32_t)c.g<<16) | ((uint32_t)c.b<<8) | c.a;
+#else
+    return ((uint32_t)c.a<<24) | ((uint32_t)c.b<<16) | ((uint32_t)c.g<<8) | c.r;
+#endif
+}
+
+typedef struct {
+    const uint8_t *idx; /* iw x ih index plane */
+    int iw;
+    int scale;          /* each index becomes scale x scale pixels */
+    uint32_t *pixels;
+    uint32_t lut[PALETTE_COUNT];
+} ExpandJob;
+
+static void expand_band(void *ctx, int y0, int y1) {
+    ExpandJob *j = (ExpandJob*)ctx;
+    int w = j->iw * j->scale;
+    for (int y=y0;y<y1;y++){
+        const uint8_t *src = j->idx + (size_t)(y / j->scale) * j->iw;
+        uint32_t *dst = j->pixels + (size_t)y * w;
+        for (int x=0;x<j->iw;x++){
+            uint32_t p = j->lut[src[x]];
+            for (int k=0;k<j->scale;k++) *dst++ = p;
+        }
+    }
+}
+
+/* Exported pixels per cell: the zoom rounded to whole pixels, at least 1 */
+static int export_cell_size() {
+    return zoom >= 1 ? (int)(zoom + 0.5) : 1;
+}
+
+/* Expand the canvas (optionally upscaled by export_filter) to RGBA pixels in
+   the SCRATCH_PIXELS buffer, each filtered cell covering
+   export_cell_size()/factor pixels. Filtering and
+   expanding run as one job graph: per band of canvas rows a filter job and an
+   expand job that depends on it, so bands are expanded as soon as their rows
+   are filtered rather than after the whole filter pass. */
+static uint32_t *export_pixels(int *out_w, int *out_h) {
+    ensure_canvas_allocated();
+    int f = filter_factor[export_filter];
+    int scale = export_cell_size() / f > 0 ? export_cell_size() / f : 1;
+    uint64_t w64 = (uint64_t)CELLS_X * f * scale, h64 = (uint64_t)CELLS_Y * f * scale;
+    if (w64 > INT_MAX / 4 || h64 > INT_MAX || w64 * h64 > SIZE_MAX / sizeof(uint32_t)) {
+        /* SDL surfaces take an int pitch */
+        fprintf(stderr, "Export of %llux%llu pixels is too large; zoom out to export at a smaller scale\n",
+                (unsigned long long)w64, (unsigned long long)h64);
+        return NULL;
+    }
+    FilterJob *fj = NULL;
+    ExpandJob j;
+    j.idx = canvas;
+    if (export_filter != FILTER_NONE) {
+        uint8_t *dst = (uint8_t*)scratch_get(SCRATCH_FILTER, (size_t)CELLS_X * f * CELLS_Y * f);
+        fj = dst ? filter_job_new(export_filter, canvas, CELLS_X, CELLS_Y, dst) : NULL;
+        if (!fj) return NULL;
+        j.idx = fj->dst;
+    }
+    j.iw = CELLS_X * f;
+    j.scale = scale;
+    for (int i=0;i<PALETTE_COUNT;i++) j.lut[i] = pack_rgba(palette[i]);
+    int w = j.iw * j.scale;
+    int h = CELLS_Y * f * j.scale;
+    int rows_per_cell = f * j.scale;
+    /* create an RGBA32 buffer */
+    j.pixels = (uint32_t*)scratch_get(SCRATCH_PIXELS, sizeof(uint32_t) * (size_t)w * h);
+    if (!j.pixels) { free(fj); scratch_done(SCRATCH_FILTER); return NULL; }
+    int n = jobs.threads * 4;
+    if (n > JOB_QUEUE_CAP / 2) n = JOB_QUEUE_CAP / 2;
+    if (n > CELLS_Y) n = CELLS_Y;
+    if (n < 1) n = 1;
+    Job *graph = (Job*)malloc(sizeof(Job) * 2 * n);
+    if (!graph) {
+        if (fj) parallel_rows(filter_band, fj, CELLS_Y);
+        parallel_rows(expand_band, &j, h);
+    } else {
+        for (int i=0;i<n;i++){
+            int y0 = (int)((long)CELLS_Y * i / n), y1 = (int)((long)CELLS_Y * (i+1) / n);
+            Job *fjob = &graph[2*i], *ejob = &graph[2*i + 1];
+            job_init(ejob, expand_band, &j, y0 * rows_per_cell, y1 * rows_per_cell);
+            if (fj) {
+                job_init(fjob, filter_band, fj, y0, y1);
+                job_depends(ejob, fjob);
+                job_submit(fjob);
+            }
+            job_submit(ejob);
+        }
+        for (int i=0;i<n;i++) job_wait(&graph[2*i + 1]);
+        free(graph);
+    }
+    free(fj);
+    scratch_done(SCRATCH_FILTER);
+    *out_w = w; *out_h = h;
+    return j.pixels;
+}
+
+/* Save as BMP via export_pixels */
+static int save_canvas_as_bmp(const char *filename) {
+    int w, h;
+    uint32_t *pixels = export_pixels(&w, &h);
+    if (!pixels) return -1;
+    /* Create a surface with 32bit masks; SDL_SaveBMP expects a surface with appropriate masks */
+    SDL_Surface *surf = SDL_CreateRGBSurfaceFrom((void*)pixels, w, h, 32, w*4,
+#if SDL_BYTEORDER == SDL_BIG_ENDIAN
+        0xff000000, 0x00ff0000, 0x0000ff00, 0x000000ff
+#else
+        0x000000ff, 0x0000ff00, 0x00ff0000, 0xff000000
+#endif
+    );
+    if (!surf) { scratch_done(SCRATCH_PIXELS); return -1; }
+    int r = SDL_SaveBMP(surf, filename);
+    SDL_FreeSurface(surf);
+    scratch_done(SCRATCH_PIXELS);
+    return r;
+}
+
+/* Timelapse export (--timelapse journal out): replay a journal without a
+   window and write a frame every timelapse_every operations, each cell as
+   timelapse_scale x timelapse_scale pixels. A frame only carries the cells
+   changed since the previous one: in a GIF (out ends in .gif) as a sub-image
+   drawn over the last frame, in a BMP sequence (out_00001.bmp, ...) by
+   updating just that part of the expanded image before it is saved. */
+#define TIMELAPSE_DELAY 4    /* centiseconds per GIF frame */
+#define TIMELAPSE_HOLD 300   /* on the last frame before the GIF loops */
+static int timelapse_every = 10, timelapse_scale = 4;
+
+/* GIF writer: 89a with a global color table, LZW-coded frames that are
+   never disposed, so each one only has to cover what changed */
+#define GIF_BITS 4 /* color table of 2^GIF_BITS >= PALETTE_COUNT entries */
+typedef struct {
+    FILE *f;
+    uint8_t block[255];
+    int nblock;
+    uint32_t acc;
+    int nacc;
+    uint16_t *tree; /* LZW string table: code * 2^GIF_BITS + next index -> code */
+} Gif;
+
+static void gif_u16(FILE *f, int v) {
+    fputc(v & 0xff, f);
+    fputc((v >> 8) & 0xff, f);
+}
+
+static void gif_color_table(FILE *f, const SDL_Color *pal) {
+    for (int i=0;i<(1 << GIF_BITS);i++){
+        SDL_Color c = i < PALETTE_COUNT ? pal[i] : pal[0];
+        fputc(c.r, f); fputc(c.g, f); fputc(c.b, f);
+    }
+}
+
+static int gif_begin(Gif *g, FILE *f, int w, int h, const SDL_Color *pal) {
+    memset(g, 0, sizeof(*g));
+    g->f = f;
+    g->tree = (uint16_t*)malloc(sizeof(uint16_t) * (4096 << GIF_BITS));
+    if (!g->tree) return -1;
+    fwrite("GIF89a", 1, 6, f);
+    gif_u16(f, w); gif_u16(f, h);
+    fputc(0x80 | (GIF_BITS - 1) << 4 | (GIF_BITS - 1), f); /* global table */
+    fputc(0, f); fputc(0, f);
+    gif_color_table(f, pal);
+    fwrite("\x21\xff\x0bNETSCAPE2.0\x03\x01\x00\x00\x00", 1, 19, f); /* loop forever */
+    return 0;
+}
+
+static void gif_code(Gif *g, int code, int size) {
+    g->acc |= (uint32_t)code << g->nacc;
+    g->nacc += size;
+    while (g->nacc >= 8) {
+        g->block[g->nblock++] = (uint8_t)g->acc;
+        g->acc >>= 8;
+        g->nacc -= 8;
+        if (g->nblock == 255) {
+            fputc(255, g->f);
+            fwrite(g->block, 1, 255, g->f);
+            g->nblock = 0;
+        }
+    }
+}
+
+/* One frame: n indices (the w x h sub-image at x,y) with an optional local
+   color table when the palette differs from the global one */
+static void gif_frame(Gif *g, int x, int y, int w, int h, const uint8_t *idx, const SDL_Color *pal, int delay) {
+    FILE *f = g->f;
+    fwrite("\x21\xf9\x04\x04", 1, 4, f); /* graphic control: do not dispose */
+    gif_u16(f, delay);
+    fputc(0, f); fputc(0, f);
+    fputc(0x2c, f);
+    gif_u16(f, x); gif_u16(f, y); gif_u16(f, w); gif_u16(f, h);
+    fputc(pal ? 0x80 | (GIF_BITS - 1) : 0, f);
+    if (pal) gif_color_table(f, pal);
+    fputc(GIF_BITS, f);
+    const int clear = 1 << GIF_BITS;
+    int size = GIF_BITS + 1, max = clear + 1;
+    size_t n = (size_t)w * h;
+    memset(g->tree, 0, sizeof(uint16_t) * (4096 << GIF_BITS));
+    gif_code(g, clear, size);
+    int cur = idx[0];
+    for (size_t i=1;i<n;i++){
+        int next = g->tree[cur << GIF_BITS | idx[i]];
+        if (next) { cur = next; continue; }
+        gif_code(g, cur, size);
+        g->tree[cur << GIF_BITS | idx[i]] = (uint16_t)++max;
+        if (max >= 1 << size) size++;
+        if (max == 4095) {
+            gif_code(g, clear, size);
+            memset(g->tree, 0, sizeof(uint16_t) * (4096 << GIF_BITS));
+            size = GIF_BITS + 1;
+            max = clear + 1;
+        }
+        cur = idx[i];
+    }
+    gif_code(g, cur, size);
+    gif_code(g, clear + 1, size);
+    if (g->nacc) gif_code(g, 0, 8 - g->nacc);
+    if (g->nblock) {
+        fputc(g->nblock, f);
+        fwrite(g->block, 1, g->nblock, f);
+    }
+    fputc(0, f);
+    g->nblock = 0; g->acc = 0; g->nacc = 0;
+}
+
+static int gif_end(Gif *g) {
+    fputc(0x3b, g->f);
+    free(g->tree);
+    return ferror(g->f) ? -1 : 0;
+}
+
+typedef struct {
+    int sw, sh;            /* screen: the largest canvas in the journal */
+    int w, h;              /* current canvas, at the top-left of the screen */
+    uint8_t *cells;        /* sw x sh */
+    SDL_Color palette[PALETTE_COUNT];
+    Box dirty;             /* changed cells since the previous frame, x0 > x1 when none */
+    int frames;
+    const char *out;
+    Gif gif;               /* gif.f set: GIF output */
+    uint8_t *idx;          /* GIF frame indices */
+    uint32_t *pixels;      /* BMP sequence: the expanded screen */
+} Timelapse;
+
+static void tl_touch(Timelapse *t, int x0, int y0, int x1, int y1) {
+    if (t->dirty.x0 > t->dirty.x1) { Box b = { x0, y0, x1, y1 }; t->dirty = b; return; }
+    if (x0 < t->dirty.x0) t->dirty.x0 = x0;
+    if (y0 < t->dirty.y0) t->dirty.y0 = y0;
+    if (x1 > t->dirty.x1) t->dirty.x1 = x1;
+    if (y1 > t->dirty.y1) t->dirty.y1 = y1;
 }
 
-/* Save as BMP: create a surface of CELLS_X*CELL_SIZE etc and save */
-static int save_canvas_as_bmp(const char *filename) {
-    ensure_canvas_allocated();
-    int w = CELLS_X * CELL_SIZE;
-    int h = CELLS_Y * CELL_SIZE;
-    /* create an RGBA32 buffer */
-    uint32_t *pixels = (uint32_t*)malloc(sizeof(uint32_t) * w * h);
-    if (!pixels) return -1;
-    for (int y=0;y<h;y++){
-        for (int x=0;x<w;x++){
-            int cx = x / CELL_SIZE;
-            int cy = y / CELL_SIZE;
-            uint8_t cidx = canvas[cy*CELLS_X + cx];
-            SDL_Color col = palette[cidx];
-            uint32_t p = (col.r<<24) | (col.g<<16) | (col.b<<8) | col.a; /* ARGB in memory order depends on surface masks below */
-            pixels[y*w + x] = p;
+/* Emit the changed cells as a frame; with nothing changed a single pixel is
+   redrawn so the frame still takes its time slot */
+static int tl_frame(Timelapse *t, int delay) {
+    Box b = t->dirty;
+    if (b.x0 > b.x1) { b.x0 = b.y0 = 0; b.x1 = b.y1 = 0; }
+    int k = timelapse_scale, w = (b.x1 - b.x0 + 1) * k, h = (b.y1 - b.y0 + 1) * k;
+    if (t->gif.f) {
+        for (int y=0;y<h;y++){
+            const uint8_t *src = t->cells + (size_t)(b.y0 + y / k) * t->sw + b.x0;
+            uint8_t *dst = t->idx + (size_t)y * w;
+            for (int x=0;x<w;x++) dst[x] = src[x / k];
         }
-    }
-    /* Create a surface with 32bit masks; SDL_SaveBMP expects a surface with appropriate masks */
-    SDL_Surface *surf = SDL_CreateRGBSurfaceFrom((void*)pixels, w, h, 32, w*4,
+        int own = memcmp(t->palette, default_palette, sizeof(t->palette)) != 0;
+        gif_frame(&t->gif, b.x0 * k, b.y0 * k, w, h, t->idx, own ? t->palette : NULL, delay);
+    } else {
+        uint32_t lut[PALETTE_COUNT];
+        for (int i=0;i<PALETTE_COUNT;i++) lut[i] = pack_rgba(t->palette[i]);
+        int pw = t->sw * k;
+        for (int y=0;y<h;y++){
+            const uint8_t *src = t->cells + (size_t)(b.y0 + y / k) * t->sw + b.x0;
+            uint32_t *dst = t->pixels + (size_t)(b.y0 * k + y) * pw + (size_t)b.x0 * k;
+            for (int x=0;x<w;x++) dst[x] = lut[src[x / k]];
+        }
+        char path[1100];
+        snprintf(path, sizeof(path), "%s_%05d.bmp", t->out, t->frames + 1);
+        SDL_Surface *surf = SDL_CreateRGBSurfaceFrom(t->pixels, pw, t->sh * k, 32, pw * 4,
 #if SDL_BYTEORDER == SDL_BIG_ENDIAN
-        0xff000000, 0x00ff0000, 0x0000ff00, 0x000000ff
+            0xff000000, 0x00ff0000, 0x0000ff00, 0x000000ff
 #else
-        0x000000ff, 0x0000ff00, 0x00ff0000, 0xff000000
+            0x000000ff, 0x0000ff00, 0x00ff0000, 0xff000000
 #endif
-    );
-    if (!surf) {
-        free(pixels);
+        );
+        int r = surf ? SDL_SaveBMP(surf, path) : -1;
+        SDL_FreeSurface(surf);
+        if (r != 0) { fprintf(stderr, "Failed to write %s\n", path); return -1; }
+    }
+    t->frames++;
+    t->dirty.x0 = 1; t->dirty.x1 = 0;
+    return 0;
+}
+
+/* Skip len bytes; fseek takes a long, which may be 32 bits */
+static int tl_skip(FILE *f, uint64_t len) {
+    while (len > 0) {
+        long step = len > (uint64_t)LONG_MAX ? LONG_MAX : (long)len;
+        if (fseek(f, step, SEEK_CUR) != 0) return -1;
+        len -= (uint64_t)step;
+    }
+    return 0;
+}
+
+/* Read one record; with t NULL only the canvas sizes are looked at (the
+   first pass that sizes the screen). Returns 1 per operation, 0 for a
+   canvas record, -1 at the end and -2 when the journal is malformed. */
+static int tl_record(FILE *f, Timelapse *t, int *w, int *h) {
+    uint32_t type;
+    if (fread(&type, sizeof(type), 1, f) != 1) return -1;
+    if (type == JOURNAL_CANVAS) {
+        uint32_t wh[2];
+        SDL_Color pal[PALETTE_COUNT];
+        uint64_t len;
+        if (fread(wh, sizeof(wh), 1, f) != 1 || fread(pal, sizeof(pal), 1, f) != 1 ||
+            fread(&len, sizeof(len), 1, f) != 1 || !dims_valid((int)wh[0], (int)wh[1])) return -2;
+        *w = (int)wh[0]; *h = (int)wh[1];
+        size_t n = (size_t)*w * *h;
+        if (len > n) return -2;
+        if (!t) return tl_skip(f, len) == 0 ? 0 : -2;
+        uint8_t *data = (uint8_t*)malloc((size_t)len);
+        if (!data || fread(data, 1, (size_t)len, f) != len) { free(data); return -2; }
+        memset(t->cells, 0, (size_t)t->sw * t->sh);
+        /* cell values index the palette and the GIF color table: reject any beyond it */
+        if (len == n && cells_valid(data, *w, *h, *w))
+            for (int y=0;y<*h;y++) memcpy(t->cells + (size_t)y * t->sw, data + (size_t)y * *w, *w);
+        else if (len != n && rle_valid(data, (size_t)len, *w, *h)) rle_decode_rows(data, t->cells, t->sw, 0, *h);
+        else { free(data); return -2; }
+        free(data);
+        memcpy(t->palette, pal, sizeof(pal));
+        tl_touch(t, 0, 0, t->sw - 1, t->sh - 1);
+        return 0;
+    }
+    if (type != JOURNAL_TILES) return -2;
+    uint32_t ntiles;
+    if (fread(&ntiles, sizeof(ntiles), 1, f) != 1 || *w <= 0) return -2;
+    int tx = (*w + TILE_SIZE - 1) / TILE_SIZE, ty = (*h + TILE_SIZE - 1) / TILE_SIZE;
+    uint8_t snap[TILE_BYTES];
+    for (uint32_t i=0;i<ntiles;i++){
+        uint32_t hd[2];
+        if (fread(hd, sizeof(hd), 1, f) != 1 || hd[0] >= (uint32_t)tx * ty || hd[1] > TILE_BYTES ||
+            fread(snap, 1, hd[1], f) != hd[1]) return -2;
+        if (!t) continue;
+        int x = (int)(hd[0] % tx) * TILE_SIZE, y = (int)(hd[0] / tx) * TILE_SIZE;
+        int cw = *w - x < TILE_SIZE ? *w - x : TILE_SIZE, ch = *h - y < TILE_SIZE ? *h - y : TILE_SIZE;
+        uint8_t *dst = t->cells + (size_t)y * t->sw + x;
+        if (hd[1] == TILE_BYTES && cells_valid(snap, cw, ch, TILE_SIZE))
+            for (int r=0;r<ch;r++) memcpy(dst + (size_t)r * t->sw, snap + r * TILE_SIZE, cw);
+        else if (hd[1] != TILE_BYTES && rle_valid(snap, hd[1], cw, ch)) rle_decode_rows(snap, dst, t->sw, 0, ch);
+        else return -2;
+        tl_touch(t, x, y, x + cw - 1, y + ch - 1);
+    }
+    return 1;
+}
+
+static int run_timelapse(const char *journal_path, const char *out) {
+    FILE *f = fopen(journal_path, "rb");
+    if (!f) { fprintf(stderr, "Cannot open journal %s\n", journal_path); return -1; }
+    uint32_t hdr[2];
+    if (fread(hdr, sizeof(hdr), 1, f) != 1 || hdr[0] != JOURNAL_MAGIC || hdr[1] != TILE_SIZE) {
+        fprintf(stderr, "%s is not an edit journal\n", journal_path);
+        fclose(f);
         return -1;
     }
-    int r = SDL_SaveBMP(surf, filename);
-    SDL_FreeSurface(surf);
-    free(pixels);
-    return r;
+    Timelapse t;
+    memset(&t, 0, sizeof(t));
+    t.out = out;
+    t.dirty.x0 = 1; t.dirty.x1 = 0;
+    int w = 0, h = 0, r, ops = 0;
+    while ((r = tl_record(f, NULL, &w, &h)) >= 0) {
+        if (w > t.sw) t.sw = w;
+        if (h > t.sh) t.sh = h;
+    }
+    if (r == -2 && feof(f)) r = -1; /* the last record was cut short by a crash */
+    size_t ext = strlen(out);
+    int gif = ext > 4 && strcmp(out + ext - 4, ".gif") == 0;
+    uint64_t pw = (uint64_t)t.sw * timelapse_scale, ph = (uint64_t)t.sh * timelapse_scale;
+    if (r == -2 || t.sw == 0) fprintf(stderr, "%s is malformed or empty\n", journal_path);
+    else if (gif ? pw > 65535 || ph > 65535 : pw > INT_MAX / 4 || pw * ph > SIZE_MAX / sizeof(uint32_t))
+        fprintf(stderr, "Frames of %llux%llu pixels are too large; lower --scale\n", (unsigned long long)pw, (unsigned long long)ph);
+    else if (!(t.cells = (uint8_t*)calloc((size_t)t.sw * t.sh, 1)) ||
+             !(gif ? (t.idx = (uint8_t*)malloc((size_t)(pw * ph))) != NULL : (t.pixels = (uint32_t*)malloc((size_t)(pw * ph) * 4)) != NULL))
+        fprintf(stderr, "Failed to allocate %llux%llu frame\n", (unsigned long long)pw, (unsigned long long)ph);
+    else {
+        FILE *gf = NULL;
+        memcpy(t.palette, default_palette, sizeof(t.palette));
+        if (gif) {
+            gf = fopen(out, "wb");
+            if (!gf || gif_begin(&t.gif, gf, (int)pw, (int)ph, default_palette) != 0) {
+                fprintf(stderr, "Cannot write %s\n", out);
+                if (gf) fclose(gf);
+                gf = NULL;
+                r = -2;
+            }
+        }
+        if (r != -2) {
+            if (!gif) {
+                /* strip a .bmp extension, frames get numbered names */
+                static char base[1024];
+                snprintf(base, sizeof(base), "%s", out);
+                if (ext > 4 && strcmp(base + ext - 4, ".bmp") == 0) base[ext - 4] = '\0';
+                t.out = base;
+            }
+            fseek(f, sizeof(hdr), SEEK_SET);
+            w = h = 0;
+            while ((r = tl_record(f, &t, &w, &h)) >= 0) {
+                if (r == 1 && ++ops % timelapse_every == 0 && tl_frame(&t, TIMELAPSE_DELAY) != 0) { r = -2; break; }
+                /* the first frame shows the canvas as the first session opened it */
+                if (r == 0 && t.frames == 0 && tl_frame(&t, TIMELAPSE_DELAY) != 0) { r = -2; break; }
+            }
+            if (r == -2 && feof(f)) r = -1;
+            if (r == -1 && t.dirty.x0 <= t.dirty.x1 && tl_frame(&t, TIMELAPSE_DELAY) != 0) r = -2;
+            if (r == -1 && gif) tl_frame(&t, TIMELAPSE_HOLD); /* hold the result before looping */
+            if (gif && gf) {
+                if (gif_end(&t.gif) != 0) r = -2;
+                if (fclose(gf) != 0) r = -2;
+            }
+            if (r == -1) printf("Timelapse: %d operations, %d frames written to %s\n", ops, t.frames, out);
+            else fprintf(stderr, "Timelapse of %s failed\n", journal_path);
+        }
+    }
+    free(t.cells);
+    free(t.idx);
+    free(t.pixels);
+    fclose(f);
+    return r == -1 ? 0 : -1;
 }
 
 /* Find nearest palette index by Euclidean distance in RGB space */
-static int nearest_palette_index(SDL_Color c) {
+static int nearest_index(const SDL_Color *pal, SDL_Color c) {
     int best = 0;
     int bestd = INT32_MAX;
     for (int i=0;i<PALETTE_COUNT;i++){
-        int dr = (int)c.r - palette[i].r;
-        int dg = (int)c.g - palette[i].g;
-        int db = (int)c.b - palette[i].b;
+        int dr = (int)c.r - pal[i].r;
+        int dg = (int)c.g - pal[i].g;
+        int db = (int)c.b - pal[i].b;
         int d = dr*dr + dg*dg + db*db;
         if (d < bestd) { bestd = d; best = i; }
     }
     return best;
 }
 
-/* Load BMP and map into canvas by sampling center of each cell */
-static int load_bmp_to_canvas(const char *filename) {
-    SDL_Surface *surf = SDL_LoadBMP(filename);
-    if (!surf) return -1;
-    SDL_Surface *fmt = SDL_ConvertSurfaceFormat(surf, SDL_PIXELFORMAT_RGB24, 0);
-    SDL_FreeSurface(surf);
-    if (!fmt) return -1;
+static int nearest_palette_index(SDL_Color c) {
+    return nearest_index(palette, c);
+}
+
+/* Map an RGB24 surface into the canvas by sampling the center of each cell;
+   rows of cells are mapped in parallel */
+static void map_band(void *ctx, int y0, int y1) {
+    SDL_Surface *fmt = (SDL_Surface*)ctx;
     int img_w = fmt->w, img_h = fmt->h;
     uint8_t *pixels = (uint8_t*)fmt->pixels;
     int pitch = fmt->pitch;
-    for (int cy=0; cy<CELLS_Y; cy++){
+    for (int cy=y0; cy<y1; cy++){
         for (int cx=0; cx<CELLS_X; cx++){
             /* sample at center of cell in image coords */
             int sx = (int)(( (cx + 0.5) / (double)CELLS_X) * img_w);
             int sy = (int)(( (cy + 0.5) / (double)CELLS_Y) * img_h);
             if (sx < 0) sx = 0; if (sx >= img_w) sx = img_w-1;
             if (sy < 0) sy = 0; if (sy >= img_h) sy = img_h-1;
-            uint8_t *p = pixels + sy * pitch + sx*3;
+            uint8_t *p = pixels + (size_t)sy*pitch + sx*3;
             SDL_Color c = { p[0], p[1], p[2], 255 };
             int pi = nearest_palette_index(c);
-            canvas[cy*CELLS_X + cx] = (uint8_t)pi;
+            canvas[(size_t)cy*CELLS_X + cx] = (uint8_t)pi;
+        }
+    }
+}
+
+/* Load a BMP as RGB24. With use_scratch the converted pixels go to the
+   SCRATCH_IMPORT buffer (valid until the next import) instead of a second
+   full-size surface allocation; freeing the surface leaves them alone. */
+static SDL_Surface *load_bmp_rgb24(const char *filename, int use_scratch) {
+    SDL_Surface *surf = SDL_LoadBMP(filename);
+    if (!surf) return NULL;
+    SDL_Surface *fmt = NULL;
+    if (!use_scratch) fmt = SDL_ConvertSurfaceFormat(surf, SDL_PIXELFORMAT_RGB24, 0);
+    else {
+        int pitch = (surf->w * 3 + 3) & ~3;
+        void *px = scratch_get(SCRATCH_IMPORT, (size_t)pitch * surf->h);
+        if (px) fmt = SDL_CreateRGBSurfaceWithFormatFrom(px, surf->w, surf->h, 24, pitch, SDL_PIXELFORMAT_RGB24);
+        /* a plain copy with conversion, also for paletted sources */
+        SDL_SetSurfaceBlendMode(surf, SDL_BLENDMODE_NONE);
+        if (fmt && SDL_BlitSurface(surf, NULL, fmt, NULL) != 0) { SDL_FreeSurface(fmt); fmt = NULL; }
+    }
+    SDL_FreeSurface(surf);
+    return fmt;
+}
+
+/* Load BMP and map into canvas by sampling center of each cell */
+static int load_bmp_to_canvas(const char *filename) {
+    SDL_Surface *fmt = load_bmp_rgb24(filename, 1);
+    if (!fmt || edit_touch(0, 0, CELLS_X-1, CELLS_Y-1) != 0) {
+        if (fmt) SDL_FreeSurface(fmt);
+        scratch_done(SCRATCH_IMPORT);
+        return -1;
+    }
+    parallel_rows(map_band, fmt, CELLS_Y);
+    SDL_FreeSurface(fmt);
+    scratch_done(SCRATCH_IMPORT);
+    mark_all_dirty();
+    return 0;
+}
+
+/* Workspace: a directory of BMP documents (--workspace dir). Indexing only
+   lists the file names; a document is decoded when it is first opened. The
+   arenas of all open documents are kept within ws.budget bytes by evicting
+   the least recently used workspace document other than the active one: its
+   cells and palette are written to WS_CACHE_DIR, raw or as the RLE blob of a
+   sparse document, and reopening it is one fread instead of decoding and
+   palette-matching the BMP again. Evicting drops the document's undo
+   history; the cache only lives for the session. */
+#define WS_CACHE_DIR ".pixel_cache"
+#define WS_CACHE_MAGIC 0x31435850u     /* "PXC1": raw cells */
+#define WS_CACHE_RLE_MAGIC 0x31525850u /* "PXR1": RLE blob */
+
+static void ws_path(char *out, size_t size, int e, int cache) {
+    if (cache) snprintf(out, size, "%s/" WS_CACHE_DIR "/%s.cells", ws.dir, ws.entries[e].name);
+    else snprintf(out, size, "%s/%s", ws.dir, ws.entries[e].name);
+}
+
+static int ws_add(const char *name) {
+    size_t n = strlen(name);
+    if (n < 5 || n >= sizeof(ws.entries[0].name)) return 0;
+    char ext[5];
+    for (int i=0;i<4;i++) ext[i] = (char)(name[n-4+i] >= 'A' && name[n-4+i] <= 'Z' ? name[n-4+i] + 32 : name[n-4+i]);
+    ext[4] = '\0';
+    if (strcmp(ext, ".bmp") != 0) return 0;
+    if (ws.count == ws.cap) {
+        int ncap = ws.cap ? ws.cap * 2 : 64;
+        WsEntry *ne = (WsEntry*)realloc(ws.entries, sizeof(WsEntry) * ncap);
+        if (!ne) return -1;
+        ws.entries = ne;
+        ws.cap = ncap;
+    }
+    memset(&ws.entries[ws.count], 0, sizeof(WsEntry));
+    strcpy(ws.entries[ws.count].name, name);
+    ws.count++;
+    return 0;
+}
+
+static int ws_entry_cmp(const void *a, const void *b) {
+    return strcmp(((const WsEntry*)a)->name, ((const WsEntry*)b)->name);
+}
+
+static void thumbs_load_index();
+
+/* Index the BMP files of dir (names only) and set up its cache directory */
+static int ws_index(const char *dir) {
+    snprintf(ws.dir, sizeof(ws.dir), "%s", dir);
+    ws.count = 0;
+#ifdef _WIN32
+    char pattern[1100];
+    snprintf(pattern, sizeof(pattern), "%s\\*.bmp", dir);
+    WIN32_FIND_DATAA fd;
+    HANDLE h = FindFirstFileA(pattern, &fd);
+    if (h != INVALID_HANDLE_VALUE) {
+        do ws_add(fd.cFileName); while (FindNextFileA(h, &fd));
+        FindClose(h);
+    }
+#else
+    DIR *d = opendir(dir);
+    if (!d) return -1;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL) ws_add(de->d_name);
+    closedir(d);
+#endif
+    qsort(ws.entries, ws.count, sizeof(WsEntry), ws_entry_cmp);
+    char path[1400];
+    snprintf(path, sizeof(path), "%s/" WS_CACHE_DIR, ws.dir);
+#ifdef _WIN32
+    _mkdir(path);
+#else
+    mkdir(path, 0755);
+#endif
+    /* anything left over from an earlier session is stale */
+    for (int e=0;e<ws.count;e++){
+        ws_path(path, sizeof(path), e, 1);
+        remove(path);
+    }
+    thumbs_load_index();
+    return 0;
+}
+
+static int ws_find_doc(int e) {
+    for (int i=0;i<doc_count;i++) if (docs[i].ws_entry == e) return i;
+    return -1;
+}
+
+static size_t docs_resident_bytes() {
+    size_t n = 0;
+    for (int i=0;i<doc_count;i++) n += docs[i].arena.bytes;
+    return n;
+}
+
+/* Write parked document i to the cache and close it */
+static int ws_evict(int i) {
+    Document *d = &docs[i];
+    int e = d->ws_entry;
+    char path[1400];
+    ws_path(path, sizeof(path), e, 1);
+    FILE *f = fopen(path, "wb");
+    if (!f) return -1;
+    uint32_t hdr[3] = { d->rle ? WS_CACHE_RLE_MAGIC : WS_CACHE_MAGIC, (uint32_t)d->cells_x, (uint32_t)d->cells_y };
+    size_t n = d->rle ? rle_bytes(d->cells_y, ((RleHeader*)d->rle)->nruns) : (size_t)d->cells_x * d->cells_y;
+    int ok = fwrite(hdr, sizeof(hdr), 1, f) == 1 && fwrite(d->palette, sizeof(d->palette), 1, f) == 1 &&
+             fwrite(d->rle ? d->rle : d->canvas, 1, n, f) == n;
+    if (fclose(f) != 0) ok = 0;
+    if (!ok) { remove(path); return -1; }
+    ws.entries[e].cached = 1;
+    return doc_remove(i);
+}
+
+/* Evict the least recently used workspace document that is not active */
+static int ws_evict_lru() {
+    int best = -1;
+    for (int i=0;i<doc_count;i++){
+        if (i == doc_cur || docs[i].ws_entry < 0) continue;
+        if (best < 0 || docs[i].last_use < docs[best].last_use) best = i;
+    }
+    return best < 0 ? -1 : ws_evict(best);
+}
+
+/* Largest k such that the image is made of uniform k x k blocks, i.e. the
+   cell size it was exported at */
+static int bmp_cell_size(SDL_Surface *img) {
+    int a = img->w, b = img->h;
+    while (b) { int t = a % b; a = b; b = t; }
+    for (int k=a; k>1; k--){
+        if (a % k) continue;
+        int uniform = 1;
+        for (int y=0; y<img->h && uniform; y++){
+            const uint8_t *row = (const uint8_t*)img->pixels + y * img->pitch;
+            const uint8_t *top = (const uint8_t*)img->pixels + (y - y % k) * img->pitch;
+            for (int x=0; x<img->w; x++){
+                if (memcmp(row + x*3, top + (x - x % k)*3, 3) != 0) { uniform = 0; break; }
+            }
+        }
+        if (uniform) return k;
+    }
+    return 1;
+}
+
+/* Open the cells of entry e as a new active document */
+static int ws_load(int e) {
+    char path[1400];
+    ws_path(path, sizeof(path), e, ws.entries[e].cached);
+    if (ws.entries[e].cached) {
+        FILE *f = fopen(path, "rb");
+        if (!f) return -1;
+        uint32_t hdr[3];
+        SDL_Color pal[PALETTE_COUNT];
+        int prev = doc_cur;
+        int opened = fread(hdr, sizeof(hdr), 1, f) == 1 && (hdr[0] == WS_CACHE_MAGIC || hdr[0] == WS_CACHE_RLE_MAGIC) &&
+                     fread(pal, sizeof(pal), 1, f) == 1 && doc_new((int)hdr[1], (int)hdr[2]) == 0;
+        int ok = opened;
+        if (ok && hdr[0] == WS_CACHE_RLE_MAGIC) {
+            RleHeader rh;
+            uint8_t *blob = NULL;
+            size_t n = 0;
+            ok = fread(&rh, sizeof(rh), 1, f) == 1 && rh.w == hdr[1] && rh.h == hdr[2] &&
+                 rh.nruns >= rh.h && rh.nruns <= cell_count() &&
+                 (blob = (uint8_t*)malloc(n = rle_bytes((int)rh.h, rh.nruns))) != NULL &&
+                 fread(blob + sizeof(rh), 1, n - sizeof(rh), f) == n - sizeof(rh);
+            if (ok) {
+                memcpy(blob, &rh, sizeof(rh));
+                ok = rle_valid(blob, n, CELLS_X, CELLS_Y);
+            }
+            if (ok) {
+                RleJob j = { blob, canvas, (size_t)CELLS_X };
+                parallel_rows(rle_band, &j, CELLS_Y);
+            }
+            free(blob);
+        } else if (ok) {
+            size_t n = cell_count();
+            ok = fread(canvas, 1, n, f) == n && cells_valid(canvas, CELLS_X, CELLS_Y, CELLS_X);
+        }
+        if (ok) {
+            memcpy(palette, pal, sizeof(pal));
+            pack_palette();
+        } else if (opened) {
+            /* never pass a damaged cache off as a blank document: evicting
+               that would overwrite the cache, and the edits with it */
+            int bad = doc_cur; /* the last slot, so prev keeps its index */
+            fprintf(stderr, "Cannot read %s\n", path);
+            doc_switch(prev);
+            doc_remove(bad);
         }
+        fclose(f);
+        return ok ? 0 : -1;
     }
+    SDL_Surface *fmt = load_bmp_rgb24(path, 1);
+    if (!fmt) { scratch_done(SCRATCH_IMPORT); return -1; }
+    int k = bmp_cell_size(fmt);
+    int r = doc_new(fmt->w / k, fmt->h / k);
+    if (r == 0) parallel_rows(map_band, fmt, CELLS_Y);
     SDL_FreeSurface(fmt);
+    scratch_done(SCRATCH_IMPORT);
+    return r == 0 ? 0 : -1;
+}
+
+/* Make entry e the active document, loading it if it is not open */
+static int ws_open(int e) {
+    if (e < 0 || e >= ws.count) return -1;
+    int i = ws_find_doc(e);
+    if (i >= 0) { doc_switch(i); return 0; }
+    if (doc_count == DOC_MAX && ws_evict_lru() != 0) return -1;
+    Uint64 start = SDL_GetPerformanceCounter();
+    int cached = ws.entries[e].cached;
+    if (ws_load(e) != 0) return -1;
+    docs[doc_cur].ws_entry = e;
+    snprintf(docs[doc_cur].name, sizeof(docs[doc_cur].name), "%.63s", ws.entries[e].name);
+    mark_all_dirty();
+    while (docs_resident_bytes() + scratch_bytes() > ws.budget && ws_evict_lru() == 0) {}
+    printf("Opened %s (%dx%d) from %s in %.2f ms\n", ws.entries[e].name, CELLS_X, CELLS_Y, cached ? "cache" : "BMP",
+           (SDL_GetPerformanceCounter() - start) * 1000.0 / SDL_GetPerformanceFrequency());
+    return 0;
+}
+
+/* Thumbnails for the workspace browser. Worker threads decode an entry into
+   index data just as opening it would, hash the index data and palette, and
+   look the hash up in WS_CACHE_DIR/thumbs; only a miss builds the thumbnail
+   (box-averaged down, or scaled up by whole pixels, to fit THUMB_SIZE) and
+   writes it there. thumbs.idx remembers each file's size, mtime and hash,
+   so unchanged files skip the decode as well. The main thread queues the
+   visible entries first, then the next few hundred, as background jobs it
+   never runs itself, and hands finished thumbnails to the renderer a few per
+   frame. */
+#define THUMB_MAGIC 0x31485450u /* "PTH1" */
+#define THUMB_BATCH 4
+#define THUMB_JOBS 16
+#define THUMB_AHEAD 256 /* entries from the first visible one prepared ahead */
+static struct {
+    Job job[THUMB_JOBS];
+    int busy[THUMB_JOBS];
+} tj;
+
+static uint64_t thumb_hash(const uint8_t *cells, int w, int h, const SDL_Color *pal) {
+    uint64_t hash = 1469598103934665603ull;
+    int dims[2] = { w, h };
+    const uint8_t *parts[3] = { (const uint8_t*)dims, (const uint8_t*)pal, cells };
+    size_t sizes[3] = { sizeof(dims), sizeof(SDL_Color) * PALETTE_COUNT, (size_t)w * h };
+    for (int p=0;p<3;p++) for (size_t i=0;i<sizes[p];i++) { hash ^= parts[p][i]; hash *= 1099511628211ull; }
+    return hash;
+}
+
+static void thumb_file(char *out, size_t size, uint64_t hash) {
+    snprintf(out, size, "%s/" WS_CACHE_DIR "/thumbs/%016llx.thumb", ws.dir, (unsigned long long)hash);
+}
+
+static int thumb_read(WsEntry *en) {
+    char path[1400];
+    thumb_file(path, sizeof(path), en->hash);
+    FILE *f = fopen(path, "rb");
+    if (!f) return -1;
+    uint32_t hdr[3];
+    uint32_t *px = NULL;
+    int ok = fread(hdr, sizeof(hdr), 1, f) == 1 && hdr[0] == THUMB_MAGIC &&
+             hdr[1] >= 1 && hdr[1] <= THUMB_SIZE && hdr[2] >= 1 && hdr[2] <= THUMB_SIZE &&
+             (px = (uint32_t*)malloc(sizeof(uint32_t) * hdr[1] * hdr[2])) != NULL &&
+             fread(px, sizeof(uint32_t) * hdr[1] * hdr[2], 1, f) == 1;
+    fclose(f);
+    if (!ok) { free(px); return -1; }
+    en->thumb_px = px; en->thumb_w = (int)hdr[1]; en->thumb_h = (int)hdr[2];
+    return 0;
+}
+
+static void thumb_write(const WsEntry *en) {
+    char path[1400];
+    thumb_file(path, sizeof(path), en->hash);
+    FILE *f = fopen(path, "wb");
+    if (!f) return;
+    uint32_t hdr[3] = { THUMB_MAGIC, (uint32_t)en->thumb_w, (uint32_t)en->thumb_h };
+    int ok = fwrite(hdr, sizeof(hdr), 1, f) == 1 &&
+             fwrite(en->thumb_px, sizeof(uint32_t) * en->thumb_w * en->thumb_h, 1, f) == 1;
+    if (fclose(f) != 0 || !ok) remove(path);
+}
+
+/* Fit w x h cells into THUMB_SIZE: k x k cells per texel when larger, f x f
+   texels per cell when smaller */
+static int thumb_build(WsEntry *en, const uint8_t *cells, int w, int h, const SDL_Color *pal) {
+    int big = w > h ? w : h;
+    int k = (big + THUMB_SIZE - 1) / THUMB_SIZE, f = big <= THUMB_SIZE ? THUMB_SIZE / big : 1;
+    int tw = (w + k - 1) / k * f, th = (h + k - 1) / k * f;
+    uint32_t *px = (uint32_t*)malloc(sizeof(uint32_t) * tw * th);
+    if (!px) return -1;
+    for (int ty=0; ty<th; ty++){
+        for (int tx=0; tx<tw; tx++){
+            int x0 = tx / f * k, y0 = ty / f * k;
+            int x1 = x0 + k < w ? x0 + k : w, y1 = y0 + k < h ? y0 + k : h;
+            uint64_t r = 0, g = 0, b = 0, n = 0; /* k*k cells can exceed 32 bits of sums */
+            for (int y=y0; y<y1; y++) for (int x=x0; x<x1; x++){
+                SDL_Color c = pal[cells[(size_t)y * w + x]];
+                r += c.r; g += c.g; b += c.b; n++;
+            }
+            px[ty*tw + tx] = 0xFF000000u | (uint32_t)((r/n) << 16) | (uint32_t)((g/n) << 8) | (uint32_t)(b/n);
+        }
+    }
+    en->thumb_px = px; en->thumb_w = tw; en->thumb_h = th;
     return 0;
 }
 
+static void thumb_make(WsEntry *en, const char *path) {
+    struct stat st;
+    long long size = -1, mtime = -1;
+    if (stat(path, &st) == 0) { size = (long long)st.st_size; mtime = (long long)st.st_mtime; }
+    if (en->known && en->size == size && en->mtime == mtime && thumb_read(en) == 0) return;
+    SDL_Surface *fmt = load_bmp_rgb24(path, 0); /* worker thread */
+    if (!fmt) return;
+    int k = bmp_cell_size(fmt);
+    int w = fmt->w / k, h = fmt->h / k;
+    uint8_t *cells = (uint8_t*)malloc((size_t)w * h);
+    if (cells) {
+        /* the same index data ws_load produces: one sample per cell */
+        for (int y=0;y<h;y++){
+            const uint8_t *row = (const uint8_t*)fmt->pixels + ((size_t)y*k + k/2) * fmt->pitch;
+            for (int x=0;x<w;x++){
+                const uint8_t *p = row + ((size_t)x*k + k/2) * 3;
+                SDL_Color c = { p[0], p[1], p[2], 255 };
+                cells[(size_t)y * w + x] = (uint8_t)nearest_index(default_palette, c);
+            }
+        }
+        en->hash = thumb_hash(cells, w, h, default_palette);
+        en->size = size; en->mtime = mtime; en->known = 1;
+        if (thumb_read(en) != 0 && thumb_build(en, cells, w, h, default_palette) == 0) thumb_write(en);
+        free(cells);
+    }
+    SDL_FreeSurface(fmt);
+}
+
+/* Job body: entries e0..e1-1 */
+static void thumb_band(void *ctx, int e0, int e1) {
+    (void)ctx;
+    for (int e=e0; e<e1; e++){
+        char path[1400];
+        ws_path(path, sizeof(path), e, 0);
+        thumb_make(&ws.entries[e], path);
+        SDL_AtomicSet(&ws.entries[e].thumb_state, THUMB_READY); /* publishes thumb_px */
+    }
+}
+
+/* Queue batches of entries without a thumbnail, from the first visible one
+   up to THUMB_AHEAD entries on. Finished thumbnails that were never sent and
+   are now that far from the view are dropped (the disk cache brings them
+   back quickly), so unsent pixels never pile up while scrolling. */
+static void thumbs_schedule() {
+    if (ws.count == 0) return;
+    ViewState v = current_view();
+    int start = browser_top * browser_cols(&v);
+    if (start >= ws.count) start = 0;
+    int end = start + THUMB_AHEAD < ws.count ? start + THUMB_AHEAD : ws.count;
+    for (int e=0; e<ws.count; e++){
+        WsEntry *en = &ws.entries[e];
+        if ((e < start - THUMB_AHEAD || e >= end) && SDL_AtomicGet(&en->thumb_state) == THUMB_READY) {
+            free(en->thumb_px);
+            en->thumb_px = NULL;
+            SDL_AtomicSet(&en->thumb_state, THUMB_NONE);
+        }
+    }
+    int e = start;
+    for (int j=0; j<THUMB_JOBS; j++){
+        if (tj.busy[j] && SDL_AtomicGet(&tj.job[j].done)) tj.busy[j] = 0;
+        if (tj.busy[j]) continue;
+        while (e < end && SDL_AtomicGet(&ws.entries[e].thumb_state) != THUMB_NONE) e++;
+        if (e == end) return;
+        int e0 = e;
+        while (e < end && e - e0 < THUMB_BATCH && SDL_AtomicGet(&ws.entries[e].thumb_state) == THUMB_NONE) {
+            SDL_AtomicSet(&ws.entries[e].thumb_state, THUMB_QUEUED);
+            e++;
+        }
+        job_init(&tj.job[j], thumb_band, NULL, e0, e);
+        tj.busy[j] = 1;
+        job_submit_background(&tj.job[j]);
+    }
+}
+
+/* Send up to budget finished thumbnails of the visible rows to the renderer */
+static int thumbs_publish(int budget) {
+    ViewState v = current_view();
+    int first = browser_top * browser_cols(&v), last = first + browser_rows(&v) * browser_cols(&v), sent = 0;
+    if (last > ws.count) last = ws.count;
+    for (int e=first; e<last && sent<budget; e++){
+        WsEntry *en = &ws.entries[e];
+        if (SDL_AtomicGet(&en->thumb_state) != THUMB_READY) continue;
+        if (en->thumb_px) {
+            RenderCmd c;
+            memset(&c, 0, sizeof(c));
+            c.type = RCMD_THUMB; c.count = e; c.ow = en->thumb_w; c.oh = en->thumb_h; c.data = en->thumb_px;
+            if (rq_push(&c) != 0) break;
+            en->thumb_px = NULL;
+            sent++;
+        }
+        SDL_AtomicSet(&en->thumb_state, THUMB_SENT);
+    }
+    return sent;
+}
+
+static void thumbs_index_path(char *out, size_t size) {
+    snprintf(out, size, "%s/" WS_CACHE_DIR "/thumbs.idx", ws.dir);
+}
+
+/* Read file size, mtime and hash per entry from thumbs.idx */
+static void thumbs_load_index() {
+    char path[1400], line[512], name[256];
+    snprintf(path, sizeof(path), "%s/" WS_CACHE_DIR "/thumbs", ws.dir);
+#ifdef _WIN32
+    _mkdir(path);
+#else
+    mkdir(path, 0755);
+#endif
+    thumbs_index_path(path, sizeof(path));
+    FILE *f = fopen(path, "r");
+    if (!f) return;
+    while (fgets(line, sizeof(line), f)) {
+        unsigned long long hash;
+        long long size, mtime;
+        if (sscanf(line, "%llx %lld %lld %255[^\n]", &hash, &size, &mtime, name) != 4) continue;
+        WsEntry key;
+        strcpy(key.name, name);
+        WsEntry *en = (WsEntry*)bsearch(&key, ws.entries, ws.count, sizeof(WsEntry), ws_entry_cmp);
+        if (!en) continue;
+        en->hash = hash; en->size = size; en->mtime = mtime; en->known = 1;
+    }
+    fclose(f);
+}
+
+/* Wait for queued thumbnail jobs, save thumbs.idx and drop unsent thumbnails */
+static void thumbs_finish() {
+    for (int j=0;j<THUMB_JOBS;j++) if (tj.busy[j]) job_wait(&tj.job[j]);
+    memset(&tj, 0, sizeof(tj));
+    if (ws.count == 0) return;
+    char path[1400];
+    thumbs_index_path(path, sizeof(path));
+    FILE *f = fopen(path, "w");
+    for (int e=0;e<ws.count;e++){
+        WsEntry *en = &ws.entries[e];
+        if (f && en->known) fprintf(f, "%016llx %lld %lld %s\n", (unsigned long long)en->hash, en->size, en->mtime, en->name);
+        free(en->thumb_px);
+        en->thumb_px = NULL;
+    }
+    if (f) fclose(f);
+}
+
+/* Time the export and import passes with 1, 2, 4 ... 32 threads */
+static void run_thread_benchmark() {
+    int counts[] = { 1, 2, 4, 8, 16, 32 };
+    int saved_filter = export_filter;
+    SDL_Surface *img = SDL_CreateRGBSurfaceWithFormat(0, CELLS_X * 4, CELLS_Y * 4, 24, SDL_PIXELFORMAT_RGB24);
+    if (!img) { fprintf(stderr, "Failed to allocate benchmark image\n"); return; }
+    for (int y=0;y<img->h;y++){
+        uint8_t *p = (uint8_t*)img->pixels + (size_t)y * img->pitch;
+        for (int x=0;x<img->w*3;x++) p[x] = (uint8_t)(x * 7 + y * 3);
+    }
+    for (size_t i=0;i<cell_count();i++) canvas[i] = (uint8_t)((i / 5 + i / CELLS_X / 3) % PALETTE_COUNT);
+    export_filter = FILTER_XBR2X;
+    printf("Thread scaling on %dx%d cells (%d CPUs): export = xbr2x + expand, import = map BMP\n",
+           CELLS_X, CELLS_Y, SDL_GetCPUCount());
+    double base[2] = { 0, 0 };
+    for (int c=0;c<(int)(sizeof(counts)/sizeof(counts[0]));c++){
+        jobs_shutdown();
+        jobs_init(counts[c]);
+        double secs[2];
+        for (int pass=0;pass<2;pass++){
+            int iters = 0;
+            Uint64 start = SDL_GetPerformanceCounter(), elapsed;
+            do {
+                if (pass == 0) { int w, h; export_pixels(&w, &h); }
+                else parallel_rows(map_band, img, CELLS_Y);
+                iters++;
+                elapsed = SDL_GetPerformanceCounter() - start;
+            } while (elapsed < SDL_GetPerformanceFrequency() / 2 || iters < 3);
+            secs[pass] = (double)elapsed / SDL_GetPerformanceFrequency() / iters;
+            if (c == 0) base[pass] = secs[pass];
+        }
+        printf("  %2d threads: export %8.2f ms (%5.2fx)  import %8.2f ms (%5.2fx)\n", counts[c],
+               secs[0] * 1e3, base[0] / secs[0], secs[1] * 1e3, base[1] / secs[1]);
+    }
+    export_filter = saved_filter;
+    SDL_FreeSurface(img);
+}
+
+/* Z-order (Morton) tiled cell layout. Cells are grouped in 8x8 tiles of one
+   cache line each, row-major inside the tile; the 64 tiles of a 64x64 block
+   (one 4 KB page) are stored in Morton order of their tile coordinates, and
+   blocks are row-major. A 2D neighbourhood then touches a few adjacent lines
+   instead of one line per canvas row, and a file-backed canvas would page
+   in squares rather than full-width strips. Rows are still read quickly by
+   walking them eight cells (one tile row) at a time, as morton_read_row does
+   for export. The live canvas stays row-major, because painting, undo tiles,
+   uploads and the RLE codec all address it by rows; --bench-layout measures
+   what the layout buys on 2D-local tool access patterns. */
+#define MORTON_BLOCK 64
+typedef struct {
+    int w, h;
+    int bw;              /* blocks per block row */
+    uint8_t *cells;      /* bw * block rows * MORTON_BLOCK^2 cells */
+} MortonCells;
+
+/* Interleave the low 3 bits of x and y (x in the even bits) */
+static unsigned morton3(unsigned x, unsigned y) {
+    x = (x | x << 2) & 0x33; x = (x | x << 1) & 0x55;
+    y = (y | y << 2) & 0x33; y = (y | y << 1) & 0x55;
+    return x | y << 1;
+}
+
+static size_t morton_index(const MortonCells *m, int x, int y) {
+    size_t block = (size_t)(y >> 6) * m->bw + (x >> 6);
+    return block << 12 | (size_t)morton3((x >> 3) & 7, (y >> 3) & 7) << 6 | (size_t)(y & 7) << 3 | (x & 7);
+}
+
+static int morton_alloc(MortonCells *m, int w, int h) {
+    m->w = w; m->h = h;
+    m->bw = (w + MORTON_BLOCK - 1) / MORTON_BLOCK;
+    m->cells = (uint8_t*)calloc((size_t)m->bw * ((h + MORTON_BLOCK - 1) / MORTON_BLOCK), MORTON_BLOCK * MORTON_BLOCK);
+    return m->cells ? 0 : -1;
+}
+
+/* Cells x0..x1-1 of row y into dst, one tile row (8 cells) per copy */
+static void morton_read_row(const MortonCells *m, int y, int x0, int x1, uint8_t *dst) {
+    int x = x0;
+    for (; x < x1 && (x & 7); x++) *dst++ = m->cells[morton_index(m, x, y)];
+    /* whole tile rows: the row's offset inside each block only depends on the tile column */
+    const uint8_t *row = m->cells + ((size_t)(y >> 6) * m->bw << 12) + ((size_t)(y & 7) << 3);
+    size_t off[8];
+    for (int t=0;t<8;t++) off[t] = (size_t)morton3(t, (y >> 3) & 7) << 6;
+    for (; x + 8 <= x1; x += 8, dst += 8)
+        memcpy(dst, row + ((size_t)(x >> 6) << 12) + off[(x >> 3) & 7], 8);
+    for (; x < x1; x++) *dst++ = m->cells[morton_index(m, x, y)];
+}
+
+static void morton_write_row(MortonCells *m, int y, int x0, int x1, const uint8_t *src) {
+    for (int x=x0; x<x1; ){
+        int n = 8 - (x & 7) < x1 - x ? 8 - (x & 7) : x1 - x;
+        memcpy(m->cells + morton_index(m, x, y), src, n);
+        src += n; x += n;
+    }
+}
+
+/* One benchmark subject: the same w x h cells in either layout, plus the
+   fill's seen flags in the same layout (as fill_seen shadows the canvas).
+   When seen is set, every access also records the 64-byte lines and 4 KB
+   pages it falls in, counting the distinct ones touched by the current
+   operation (op); the flags count as a second canvas after the cells. */
+typedef struct {
+    int morton;
+    int w, h;
+    int win;             /* side of the rotated and filled squares */
+    size_t ncells;       /* cells in the layout, padding included */
+    uint8_t *rows;       /* row-major */
+    MortonCells mc;
+    uint8_t *marks;      /* ncells seen flags */
+    uint32_t *seen;      /* per cache line: last op that touched it */
+    uint32_t *seen_page; /* per page */
+    uint32_t op;
+    size_t lines, pages;
+} LayoutBench;
+
+/* Scratch of the kernels: a row buffer, the fill's seed stack and spans */
+typedef struct {
+    uint8_t *row;
+    int *stack;
+    Span *spans;
+} LayoutScratch;
+
+/* Record an access to n cells from index i of the cells (marks == 0) or flags */
+static void lb_count(LayoutBench *b, int marks, size_t i, size_t n) {
+    if (!b->seen) return;
+    i += marks ? b->ncells : 0;
+    for (size_t l = i >> 6; l <= (i + n - 1) >> 6; l++){
+        if (b->seen[l] == b->op) continue;
+        b->seen[l] = b->op;
+        b->lines++;
+        if (b->seen_page[l >> 6] != b->op) { b->seen_page[l >> 6] = b->op; b->pages++; }
+    }
+}
+
+static size_t lb_index(const LayoutBench *b, int x, int y) {
+    return b->morton ? morton_index(&b->mc, x, y) : (size_t)y * b->w + x;
+}
+
+static uint8_t *lb_cell(LayoutBench *b, int x, int y) {
+    size_t i = lb_index(b, x, y);
+    lb_count(b, 0, i, 1);
+    return (b->morton ? b->mc.cells : b->rows) + i;
+}
+
+static uint8_t *lb_mark(LayoutBench *b, int x, int y) {
+    size_t i = lb_index(b, x, y);
+    lb_count(b, 1, i, 1);
+    return b->marks + i;
+}
+
+/* Set cells (or flags) x0..x1 of row y, as fill_row_span does: one memset
+   per contiguous piece, i.e. the whole span row-major or per tile row */
+static void lb_span(LayoutBench *b, int marks, int y, int x0, int x1, uint8_t v) {
+    for (int x=x0; x<=x1; ){
+        int n = b->morton && 8 - (x & 7) < x1 - x + 1 ? 8 - (x & 7) : x1 - x + 1;
+        size_t i = lb_index(b, x, y);
+        lb_count(b, marks, i, (size_t)n);
+        memset((marks ? b->marks : b->morton ? b->mc.cells : b->rows) + i, v, n);
+        x += n;
+    }
+}
+
+/* Brush stamping as a stroke paints: a radius 6 round brush rasterized like
+   rebuild_brush_stamp, one span per row, at pseudo-random positions */
+static void lb_stamp(LayoutBench *b, int i) {
+    const int r = 6;
+    unsigned h = (unsigned)i * 2654435761u;
+    int cx = r + (int)(h % (unsigned)(b->w - 2*r)), cy = r + (int)((h >> 8) % (unsigned)(b->h - 2*r));
+    for (int dy=-r; dy<=r; dy++){
+        int half = (int)sqrt((double)(r*r + r - dy*dy));
+        lb_span(b, 0, cy + dy, cx - half, cx + half, (uint8_t)(i & 15));
+    }
+}
+
+/* Nearest-neighbour rotation of the centered square by 30 degrees, as the
+   rotate tool samples its source: each output row reads along a diagonal */
+static void lb_rotate(LayoutBench *b, int i, uint8_t *out) {
+    const double c = 0.8660254037844386, s = 0.5;
+    int n = b->win, ox = (b->w - n) / 2, oy = (b->h - n) / 2;
+    double half = n / 2.0;
+    (void)i;
+    for (int y=0;y<n;y++){
+        for (int x=0;x<n;x++){
+            double u = (x - half) * c - (y - half) * s + half, v = (x - half) * s + (y - half) * c + half;
+            int sx = (int)floor(u), sy = (int)floor(v);
+            out[x] = sx >= 0 && sx < n && sy >= 0 && sy < n ? *lb_cell(b, ox + sx, oy + sy) : 0;
+        }
+    }
+}
+
+/* The fill tool on the centered square: flood_fill_spans' scanline walk
+   (runs found cell by cell, one seed per run above and below, seen flags),
+   then the spans painted and the flags cleared span by span. The color
+   alternates so every run refills the same area. */
+static void lb_fill(LayoutBench *b, int i, LayoutScratch *sc) {
+    int sx = b->w / 2, sy = b->h / 2, n = 0, nspans = 0;
+    uint8_t target = *lb_cell(b, sx, sy), to = (uint8_t)(3 - target);
+    sc->stack[n++] = sx; sc->stack[n++] = sy;
+    (void)i;
+    while (n) {
+        int y = sc->stack[--n], x = sc->stack[--n];
+        if (*lb_mark(b, x, y) || *lb_cell(b, x, y) != target) continue;
+        int x0 = x, x1 = x;
+        while (x0 > 0 && *lb_cell(b, x0-1, y) == target && !*lb_mark(b, x0-1, y)) x0--;
+        while (x1 < b->w-1 && *lb_cell(b, x1+1, y) == target && !*lb_mark(b, x1+1, y)) x1++;
+        lb_span(b, 1, y, x0, x1, 1);
+        Span s = { y, x0, x1 };
+        sc->spans[nspans++] = s;
+        for (int ny=y-1; ny<=y+1; ny+=2){
+            if (ny < 0 || ny >= b->h) continue;
+            for (int nx=x0; nx<=x1; nx++){
+                if (*lb_cell(b, nx, ny) != target || *lb_mark(b, nx, ny)) continue;
+                sc->stack[n++] = nx; sc->stack[n++] = ny;
+                while (nx < x1 && *lb_cell(b, nx+1, ny) == target && !*lb_mark(b, nx+1, ny)) nx++;
+            }
+        }
+    }
+    for (int k=0;k<nspans;k++){
+        lb_span(b, 0, sc->spans[k].y, sc->spans[k].x0, sc->spans[k].x1, to);
+        lb_span(b, 1, sc->spans[k].y, sc->spans[k].x0, sc->spans[k].x1, 0);
+    }
+}
+
+/* Export-style full readout, one row at a time */
+static void lb_rows(LayoutBench *b, uint8_t *row) {
+    for (int y=0;y<b->h;y++){
+        if (b->morton) morton_read_row(&b->mc, y, 0, b->w, row);
+        else memcpy(row, b->rows + (size_t)y * b->w, b->w);
+    }
+}
+
+/* Stamping runs after the fill, which needs its square intact */
+static void lb_run(LayoutBench *b, int kernel, int i, LayoutScratch *sc) {
+    if (kernel == 0) lb_rotate(b, i, sc->row);
+    else if (kernel == 1) lb_fill(b, i, sc);
+    else if (kernel == 2) lb_stamp(b, i);
+    else lb_rows(b, sc->row);
+}
+
+/* Time rotation sampling, flood fill, brush stamping and row readout on a
+   row-major and a Morton-ordered copy of the same cells, and count the
+   distinct cache lines and pages each 2D operation touches: its cache and
+   TLB misses when cold, and what a file-backed canvas has to page in */
+static void run_layout_benchmark() {
+    int w = CELLS_X, h = CELLS_Y;
+    if (w < 64 || h < 64) { fprintf(stderr, "The layout benchmark needs at least 64x64 cells\n"); return; }
+    LayoutBench b[2];
+    memset(b, 0, sizeof(b));
+    /* squares of up to 1024 cells a side, so the 2D kernels outgrow the caches */
+    int win = (w < h ? w : h) / 2 < 1024 ? (w < h ? w : h) / 2 : 1024;
+    LayoutScratch scratch;
+    /* at most one span and two seeds (one per neighbouring row) per row of the square */
+    scratch.row = (uint8_t*)malloc(w > win ? w : win);
+    scratch.stack = (int*)malloc(sizeof(int) * 4 * ((size_t)win + 1));
+    scratch.spans = (Span*)malloc(sizeof(Span) * ((size_t)win + 1));
+    b[0].rows = (uint8_t*)malloc((size_t)w * h);
+    int ok = scratch.row && scratch.stack && scratch.spans && b[0].rows && morton_alloc(&b[1].mc, w, h) == 0;
+    b[0].ncells = (size_t)w * h;
+    b[1].ncells = (size_t)b[1].mc.bw * ((h + MORTON_BLOCK - 1) / MORTON_BLOCK) * MORTON_BLOCK * MORTON_BLOCK;
+    for (int l=0;l<2 && ok;l++) ok = (b[l].marks = (uint8_t*)calloc(b[l].ncells, 1)) != NULL;
+    if (!ok) {
+        fprintf(stderr, "Failed to allocate benchmark canvas\n");
+        free(scratch.row); free(scratch.stack); free(scratch.spans);
+        free(b[0].rows); free(b[1].mc.cells); free(b[0].marks); free(b[1].marks);
+        return;
+    }
+    for (int l=0;l<2;l++){ b[l].morton = l; b[l].w = w; b[l].h = h; b[l].win = win; }
+    /* background 0 with the fill square set to 1 */
+    uint8_t *row = scratch.row;
+    for (int y=0;y<h;y++){
+        int in = y >= (h - win) / 2 && y < (h - win) / 2 + win;
+        for (int x=0;x<w;x++) row[x] = in && x >= (w - win) / 2 && x < (w - win) / 2 + win;
+        memcpy(b[0].rows + (size_t)y * w, row, w);
+        morton_write_row(&b[1].mc, y, 0, w, row);
+    }
+    static const char *names[] = { "rotate", "fill", "stamp", "rows" };
+    static const int counts[] = { 2, 2, 20000, 1 }; /* operations per timed round */
+    printf("Layout benchmark on %dx%d cells, %dx%d rotate / fill squares: row-major vs Morton-ordered 8x8 tiles\n",
+           w, h, win, win);
+    printf("  %-7s %13s %13s %19s %17s\n", "", "row-major", "morton", "lines/op", "pages/op");
+    for (int k=0;k<4;k++){
+        double secs[2];
+        size_t lines[2], pages[2];
+        for (int l=0;l<2;l++){
+            int iters = 0;
+            Uint64 start = SDL_GetPerformanceCounter(), elapsed;
+            do {
+                for (int i=0;i<counts[k];i++) lb_run(&b[l], k, i, &scratch);
+                iters++;
+                elapsed = SDL_GetPerformanceCounter() - start;
+            } while (elapsed < SDL_GetPerformanceFrequency() / 4 || iters < 3);
+            secs[l] = (double)elapsed / SDL_GetPerformanceFrequency() / iters / counts[k];
+            /* a separate counting pass, so the timing runs are not instrumented */
+            size_t cells = 2 * b[l].ncells; /* cells and fill flags */
+            lines[l] = pages[l] = 0;
+            b[l].seen = k < 3 ? (uint32_t*)calloc((cells >> 6) + 1, sizeof(uint32_t)) : NULL;
+            b[l].seen_page = k < 3 ? (uint32_t*)calloc((cells >> 12) + 1, sizeof(uint32_t)) : NULL;
+            if (b[l].seen && b[l].seen_page) {
+                for (int i=0;i<counts[k];i++){
+                    b[l].op = (uint32_t)i + 1;
+                    b[l].lines = b[l].pages = 0;
+                    lb_run(&b[l], k, i, &scratch);
+                    lines[l] += b[l].lines;
+                    pages[l] += b[l].pages;
+                }
+            }
+            free(b[l].seen);
+            free(b[l].seen_page);
+            b[l].seen = b[l].seen_page = NULL;
+        }
+        if (k < 3)
+            printf("  %-7s %10.2f us %10.2f us %9.1f -> %7.1f %7.1f -> %6.1f  (%.2fx time)\n", names[k],
+                   secs[0] * 1e6, secs[1] * 1e6, (double)lines[0] / counts[k], (double)lines[1] / counts[k],
+                   (double)pages[0] / counts[k], (double)pages[1] / counts[k], secs[1] / secs[0]);
+        else
+            printf("  %-7s %10.2f ms %10.2f ms  (%.2fx time)\n", names[k], secs[0] * 1e3, secs[1] * 1e3, secs[1] / secs[0]);
+    }
+    free(scratch.row); free(scratch.stack); free(scratch.spans);
+    free(b[0].rows); free(b[1].mc.cells);
+    free(b[0].marks); free(b[1].marks);
+}
+
+/* Zoom by steps quarter-octaves keeping the canvas point under window
+   position (px,py) in place */
+static void zoom_at(int steps, double px, double py) {
+    ViewState v = current_view();
+    double cs = view_cell_size(&v);
+    double cx = (px - view_origin_x(&v)) / cs, cy = (py - view_origin_y(&v)) / cs;
+    set_zoom_level(zoom_level + steps);
+    v = current_view();
+    cs = view_cell_size(&v);
+    pan_x += px - (view_origin_x(&v) + cx * cs);
+    pan_y += py - (view_origin_y(&v) + cy * cs);
+}
+
+/* Initial window size: the canvas at a zoom that fits a typical screen, plus
+   the side panel (palette and navigator). Afterwards the window is only
+   resized by the user. */
+static void window_size(int *w, int *h) {
+    ViewState v = current_view();
+    while (zoom_level > ZOOM_LEVEL_MIN && (view_canvas_w(&v) > 1280 || view_canvas_h(&v) > 880)) {
+        set_zoom_level(zoom_level - 1);
+        v = current_view();
+    }
+    int panel_h = 10 + ((PALETTE_COUNT + 1) / 2) * 32 + 8 + NAV_MAX + 10;
+    *w = view_canvas_w(&v) + PANEL_W;
+    *h = view_canvas_h(&v) + 20 > panel_h ? view_canvas_h(&v) + 20 : panel_h;
+}
+
+static void fit_preview() {
+    if (preview_win && preview_scale) SDL_SetWindowSize(preview_win, CELLS_X * preview_scale, CELLS_Y * preview_scale);
+}
+
+/* Open the preview at scale pixels per cell, or close it with 0 */
+static void set_preview(int scale) {
+    if (scale && render_sparse()) {
+        printf("No preview for a canvas of %zu cells or more with --map-dir\n", map_threshold);
+        scale = 0;
+    }
+    preview_scale = scale;
+    if (!preview_win) return;
+    if (scale) {
+        fit_preview();
+        SDL_ShowWindow(preview_win);
+    } else SDL_HideWindow(preview_win);
+}
+
+static void browser_scroll(int rows) {
+    ViewState v = current_view();
+    int max_top = (ws.count - 1) / browser_cols(&v);
+    browser_top += rows;
+    if (browser_top > max_top) browser_top = max_top;
+    if (browser_top < 0) browser_top = 0;
+}
+
+static void doc_title(SDL_Window *win) {
+    char title[128];
+    snprintf(title, sizeof(title), "C Pixel Editor - %s (%d/%d)", docs[doc_cur].name, doc_cur + 1, doc_count);
+    SDL_SetWindowTitle(win, title);
+}
+
+static void usage(const char *prog) {
+    printf("Usage: %s [cells_x cells_y] [--filter none|scale2x|scale3x|epx|xbr2x] [--threads n]\n"
+           "       [--no-render-thread] [--workspace dir] [--mem-budget mb]\n"
+           "       [--map-dir dir] [--map-threshold mb] [--bench-filters] [--bench-threads]\n"
+           "       [--bench-layout] [--journal file] [--timelapse journal out] [--every n] [--scale k]\n", prog);
+}
+
+static int parse_filter_name(const char *name) {
+    if (strcmp(name, "epx") == 0) return FILTER_SCALE2X;
+    for (int i=0;i<FILTER_COUNT;i++) if (strcmp(name, filter_names[i]) == 0) return i;
+    return -1;
+}
+
+/* A grid side from the command line; -1 unless it is a plain number that
+   fits, so oversized values are rejected instead of wrapping like atoi */
+static int parse_side(const char *s) {
+    char *end;
+    long long v = strtoll(s, &end, 10);
+    return end != s && !*end && v > 0 && v <= CELLS_SIDE_MAX ? (int)v : -1;
+}
+
 int main(int argc, char **argv) {
-    if (argc >= 3) {
-        CELLS_X = atoi(argv[1]);
-        CELLS_Y = atoi(argv[2]);
-        if (CELLS_X <= 0) CELLS_X = 32;
-        if (CELLS_Y <= 0) CELLS_Y = 32;
+    int npos = 0, bench_filters = 0, bench_threads = 0, bench_layout = 0, threads = 0, render_threaded = 1;
+    const char *workspace = NULL, *journal_path = NULL, *timelapse_in = NULL, *timelapse_out = NULL;
+    for (int i=1;i<argc;i++){
+        if (strcmp(argv[i], "--filter") == 0 && i+1 < argc) {
+            export_filter = parse_filter_name(argv[++i]);
+            if (export_filter < 0) { usage(argv[0]); return 1; }
+        } else if (strcmp(argv[i], "--threads") == 0 && i+1 < argc) {
+            threads = atoi(argv[++i]);
+            if (threads < 1) { usage(argv[0]); return 1; }
+        } else if (strcmp(argv[i], "--workspace") == 0 && i+1 < argc) {
+            workspace = argv[++i];
+        } else if (strcmp(argv[i], "--mem-budget") == 0 && i+1 < argc) {
+            int mb = atoi(argv[++i]);
+            if (mb < 1) { usage(argv[0]); return 1; }
+            ws.budget = (size_t)mb << 20;
+        } else if (strcmp(argv[i], "--map-dir") == 0 && i+1 < argc) {
+            snprintf(map_dir, sizeof(map_dir), "%s", argv[++i]);
+        } else if (strcmp(argv[i], "--map-threshold") == 0 && i+1 < argc) {
+            int mb = atoi(argv[++i]);
+            if (mb < 1) { usage(argv[0]); return 1; }
+            map_threshold = (size_t)mb << 20;
+        } else if (strcmp(argv[i], "--journal") == 0 && i+1 < argc) {
+            journal_path = argv[++i];
+        } else if (strcmp(argv[i], "--timelapse") == 0 && i+2 < argc) {
+            timelapse_in = argv[++i];
+            timelapse_out = argv[++i];
+        } else if (strcmp(argv[i], "--every") == 0 && i+1 < argc) {
+            timelapse_every = atoi(argv[++i]);
+            if (timelapse_every < 1) { usage(argv[0]); return 1; }
+        } else if (strcmp(argv[i], "--scale") == 0 && i+1 < argc) {
+            timelapse_scale = atoi(argv[++i]);
+            if (timelapse_scale < 1) { usage(argv[0]); return 1; }
+        } else if (strcmp(argv[i], "--bench-filters") == 0) bench_filters = 1;
+        else if (strcmp(argv[i], "--bench-threads") == 0) bench_threads = 1;
+        else if (strcmp(argv[i], "--bench-layout") == 0) bench_layout = 1;
+        else if (strcmp(argv[i], "--no-render-thread") == 0) render_threaded = 0;
+        else if (argv[i][0] == '-') { usage(argv[0]); return 1; }
+        else if (npos == 0) { CELLS_X = parse_side(argv[i]); npos++; }
+        else if (npos == 1) { CELLS_Y = parse_side(argv[i]); npos++; }
+    }
+    if (!dims_valid(CELLS_X, CELLS_Y)) {
+        fprintf(stderr, "Canvas size %dx%d is invalid: each side must be 1..%d cells\n", CELLS_X, CELLS_Y, CELLS_SIDE_MAX);
+        return 1;
     }
+    strcpy(docs[0].name, "untitled 1");
+    docs[0].ws_entry = -1;
     ensure_canvas_allocated();
     init_default_palette();
-    clear_canvas();
+    rebuild_brush_stamp();
+    jobs_init(threads);
+    if (bench_filters || bench_threads || bench_layout || timelapse_in) {
+        int r = 0;
+        if (bench_filters) run_filter_benchmark();
+        if (bench_threads) run_thread_benchmark();
+        if (bench_layout) run_layout_benchmark();
+        if (timelapse_in) r = run_timelapse(timelapse_in, timelapse_out);
+        scratch_report();
+        scratch_free();
+        jobs_shutdown();
+        arena_free(doc_arena());
+        arena_pool_free();
+        return r == 0 ? 0 : 1;
+    }
 
     if (SDL_Init(SDL_INIT_VIDEO) != 0) {
         fprintf(stderr, "SDL_Init Error: %s\n", SDL_GetError());
         return 1;
     }
 
-    int win_w = CELLS_X * CELL_SIZE + 200;
-    int win_h = CELLS_Y * CELL_SIZE + 20;
+    int win_w, win_h;
+    window_size(&win_w, &win_h);
 
-    SDL_Window *win = SDL_CreateWindow("C Pixel Editor", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, win_w, win_h, SDL_WINDOW_SHOWN);
+    SDL_Window *win = SDL_CreateWindow("C Pixel Editor", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, win_w, win_h,
+                                       SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE | SDL_WINDOW_ALLOW_HIGHDPI);
     if (!win) { fprintf(stderr, "SDL_CreateWindow failed: %s\n", SDL_GetError()); SDL_Quit(); return 1; }
-    SDL_Renderer *ren = SDL_CreateRenderer(win, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
-    if (!ren) { fprintf(stderr, "SDL_CreateRenderer failed: %s\n", SDL_GetError()); SDL_DestroyWindow(win); SDL_Quit(); return 1; }
+    SDL_GetWindowSize(win, &view_w, &view_h);
+    if (workspace) {
+        if (ws_index(workspace) != 0) fprintf(stderr, "Cannot read workspace %s\n", workspace);
+        else {
+            printf("Workspace %s: %d documents\n", workspace, ws.count);
+            /* the first document replaces the blank one */
+            if (ws.count > 0 && ws_open(0) == 0) doc_remove(0);
+        }
+    }
+    doc_title(win);
+    if (journal_path && journal_open(journal_path) != 0) fprintf(stderr, "Cannot open journal %s\n", journal_path);
+    /* created hidden up front so the render thread can create its renderer along with the main one */
+    preview_win = SDL_CreateWindow("Preview", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, CELLS_X, CELLS_Y, SDL_WINDOW_HIDDEN);
+    if (!preview_win) fprintf(stderr, "Preview window unavailable: %s\n", SDL_GetError());
+    /* rendering runs on its own thread when possible; otherwise on this one */
+    SDL_Renderer *ren = NULL;
+    SDL_Thread *render = NULL;
+    if (render_threaded) {
+        rq.wake = SDL_CreateSemaphore(0);
+        rq.ready = SDL_CreateSemaphore(0);
+        if (rq.wake && rq.ready) render = SDL_CreateThread(render_thread, "render", win);
+        if (render) {
+            SDL_SemWait(rq.ready);
+            if (!rq.ren) { SDL_WaitThread(render, NULL); render = NULL; }
+        }
+        if (!render) {
+            fprintf(stderr, "Render thread unavailable, rendering on the main thread\n");
+            if (rq.wake) SDL_DestroySemaphore(rq.wake);
+            if (rq.ready) SDL_DestroySemaphore(rq.ready);
+            rq.wake = rq.ready = NULL;
+        }
+    }
+    if (!render) {
+        ren = SDL_CreateRenderer(win, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+        if (!ren) { fprintf(stderr, "SDL_CreateRenderer failed: %s\n", SDL_GetError()); SDL_DestroyWindow(win); SDL_Quit(); return 1; }
+        rq.pren = create_preview_renderer();
+    }
+    if (preview_win && !rq.pren) {
+        SDL_DestroyWindow(preview_win);
+        preview_win = NULL;
+    }
+    Uint32 win_id = SDL_GetWindowID(win);
 
     int running = 1;
     int mouse_down = 0;
     int mouse_button = 0;
+    int panning = 0;
+    mark_all_dirty();
 
     while (running) {
         SDL_Event e;
-        while (SDL_PollEvent(&e)) {
+        /* with a render thread, wait for input instead of for the next vsync */
+        int have = render ? SDL_WaitEventTimeout(&e, 8) : SDL_PollEvent(&e);
+        for (; have; have = SDL_PollEvent(&e)) {
             if (e.type == SDL_QUIT) running = 0;
-            else if (e.type == SDL_MOUSEBUTTONDOWN) {
+            else if (e.type == SDL_WINDOWEVENT && e.window.event == SDL_WINDOWEVENT_CLOSE) {
+                /* with two windows SDL no longer sends SDL_QUIT for the main one */
+                if (e.window.windowID == win_id) running = 0;
+                else set_preview(0);
+            } else if (e.type == SDL_WINDOWEVENT && e.window.event == SDL_WINDOWEVENT_SIZE_CHANGED) {
+                if (e.window.windowID == win_id) SDL_GetWindowSize(win, &view_w, &view_h);
+            } else if ((e.type == SDL_MOUSEMOTION && e.motion.windowID != win_id) ||
+                       ((e.type == SDL_MOUSEBUTTONDOWN || e.type == SDL_MOUSEBUTTONUP) && e.button.windowID != win_id) ||
+                       (e.type == SDL_MOUSEWHEEL && e.wheel.windowID != win_id)) {
+                /* the preview is view-only */
+            } else if (e.type == SDL_MOUSEWHEEL && browser) {
+                browser_scroll(-e.wheel.y);
+            } else if (e.type == SDL_MOUSEBUTTONDOWN && browser) {
+                ViewState view = current_view();
+                int be = browser_hit(&view, e.button.x, e.button.y);
+                if (be >= 0 && ws_open(be) == 0) { browser = 0; fit_preview(); doc_title(win); }
+            } else if (e.type == SDL_MOUSEWHEEL) {
+                /* zoom about the pointer */
+                int mx, my;
+                SDL_GetMouseState(&mx, &my);
+                ViewState view = current_view();
+                if (mx < view_area_w(&view) && e.wheel.y) zoom_at(e.wheel.y, mx, my);
+            } else if (e.type == SDL_MOUSEBUTTONDOWN && e.button.button == SDL_BUTTON_MIDDLE) {
+                panning = 1;
+            } else if (e.type == SDL_MOUSEBUTTONUP && e.button.button == SDL_BUTTON_MIDDLE) {
+                panning = 0;
+            } else if ((e.type == SDL_MOUSEBUTTONDOWN || e.type == SDL_MOUSEBUTTONUP) && mouse_down &&
+                       e.button.button != mouse_button) {
+                /* the other button mid-stroke: the stroke's button owns the edit until it is released */
+            } else if (e.type == SDL_MOUSEBUTTONDOWN) {
+                if (mouse_down) edit_end(); /* its release never arrived */
                 mouse_down = 1; mouse_button = e.button.button;
                 int mx = e.button.x; int my = e.button.y;
-                if (mx < CELLS_X * CELL_SIZE) {
-                    int cx = mx / CELL_SIZE;
-                    int cy = my / CELL_SIZE;
-                    if (cx >=0 && cx < CELLS_X && cy>=0 && cy<CELLS_Y) {
-                        if (mouse_button == SDL_BUTTON_LEFT) canvas[cy*CELLS_X + cx] = current_color;
-                        else if (mouse_button == SDL_BUTTON_RIGHT) canvas[cy*CELLS_X + cx] = 0;
-                    }
+                ViewState view = current_view();
+                if (rot.active) {
+                    /* rotating the selection: drag around its center to set the angle */
+                    rot.dragging = 1;
+                    rot.grab_angle = rotate_pointer_angle(mx, my) - rot.angle;
+                } else if (mx < view_area_w(&view)) {
+                    int cx, cy;
+                    cell_from_window(&view, mx, my, &cx, &cy);
+                    if ((tile_mode || (cx >=0 && cx < CELLS_X && cy>=0 && cy<CELLS_Y)) &&
+                        (mouse_button == SDL_BUTTON_LEFT || mouse_button == SDL_BUTTON_RIGHT)) {
+                        uint8_t color = (mouse_button == SDL_BUTTON_LEFT) ? (uint8_t)current_color : 0;
+                        if (current_tool == TOOL_PENCIL) {
+                            edit_begin();
+                            begin_stroke(cx, cy, color);
+                        } else if (current_tool == TOOL_FILL) {
+                            edit_begin();
+                            fill_at(wrap_coord(cx, CELLS_X), wrap_coord(cy, CELLS_Y), mouse_button == SDL_BUTTON_RIGHT);
+                            edit_end();
+                            mouse_down = 0;
+                        } else if (current_tool == TOOL_SELECT) {
+                            selecting = 1;
+                            shape_x0 = shape_x1 = cx; shape_y0 = shape_y1 = cy;
+                            set_selection(cx, cy, cx, cy);
+                        } else {
+                            /* shapes stay an overlay until the button is released */
+                            shape_active = 1; shape_color = color;
+                            shape_x0 = shape_x1 = cx; shape_y0 = shape_y1 = cy;
+                            shape_spans(current_tool, shape_x0, shape_y0, shape_x1, shape_y1, shape_filled);
+                        }
+                    } else mouse_down = 0;
                 } else {
+                    mouse_down = 0;
                     /* palette click */
-                    int pal_x = CELLS_X * CELL_SIZE + 10;
+                    int pal_x = view_area_w(&view) + 10;
                     int relx = mx - pal_x;
                     int box = 24; int spacing = 8;
                     if (relx >= 0) {
                         int col = relx / (box + spacing);
                         int row = (my - 10) / (box + spacing);
                         int idx = row*2 + col;
-                        if (idx >=0 && idx < PALETTE_COUNT) current_color = idx;
+                        if (idx >=0 && idx < PALETTE_COUNT) {
+                            if (mouse_button == SDL_BUTTON_RIGHT) secondary_color = idx;
+                            else current_color = idx;
+                        }
                     }
                 }
             } else if (e.type == SDL_MOUSEBUTTONUP) {
+                if (rot.active && rot.dragging) {
+                    rotate_commit();
+                } else if (mouse_down && shape_active) {
+                    /* commit the shape: one write pass, one dirty update, one undo step */
+                    edit_begin();
+                    apply_spans(shape_color);
+                    edit_end();
+                    shape_active = 0;
+                } else if (mouse_down && selecting) {
+                    selecting = 0;
+                } else if (mouse_down) {
+                    edit_end();
+                }
                 mouse_down = 0;
             } else if (e.type == SDL_MOUSEMOTION) {
-                if (mouse_down) {
-                    int mx = e.motion.x; int my = e.motion.y;
-                    if (mx < CELLS_X * CELL_SIZE) {
-                        int cx = mx / CELL_SIZE;
-                        int cy = my / CELL_SIZE;
-                        if (cx >=0 && cx < CELLS_X && cy>=0 && cy<CELLS_Y) {
-                            if (mouse_button == SDL_BUTTON_LEFT) canvas[cy*CELLS_X + cx] = current_color;
-                            else if (mouse_button == SDL_BUTTON_RIGHT) canvas[cy*CELLS_X + cx] = 0;
-                        }
+                if (panning) { pan_x += e.motion.xrel; pan_y += e.motion.yrel; }
+                if (rot.active && rot.dragging) {
+                    double a = rotate_pointer_angle(e.motion.x, e.motion.y) - rot.grab_angle;
+                    if (SDL_GetModState() & KMOD_SHIFT) a = floor(a / ROT_SNAP + 0.5) * ROT_SNAP;
+                    if (a != rot.angle) {
+                        rot.angle = a;
+                        rotate_update();
                     }
+                } else if (mouse_down && shape_active) {
+                    ViewState view = current_view();
+                    int cx, cy;
+                    cell_from_window(&view, e.motion.x, e.motion.y, &cx, &cy);
+                    if (cx != shape_x1 || cy != shape_y1) {
+                        shape_x1 = cx; shape_y1 = cy;
+                        shape_spans(current_tool, shape_x0, shape_y0, shape_x1, shape_y1, shape_filled);
+                    }
+                } else if (mouse_down && selecting) {
+                    ViewState view = current_view();
+                    cell_from_window(&view, e.motion.x, e.motion.y, &shape_x1, &shape_y1);
+                    set_selection(shape_x0, shape_y0, shape_x1, shape_y1);
+                } else if (mouse_down) {
+                    /* join to the previous cell so fast strokes have no gaps; off-canvas parts are clipped (or wrapped) */
+                    ViewState view = current_view();
+                    int cx, cy;
+                    cell_from_window(&view, e.motion.x, e.motion.y, &cx, &cy);
+                    continue_stroke(cx, cy);
                 }
             } else if (e.type == SDL_KEYDOWN) {
                 SDL_Keycode k = e.key.keysym.sym;
-                if (k == SDLK_ESCAPE) running = 0;
-                else if (k == SDLK_c) clear_canvas();
+                int ctrl = (e.key.keysym.mod & KMOD_CTRL) != 0;
+                int shift = (e.key.keysym.mod & KMOD_SHIFT) != 0;
+                if (rot.active) {
+                    /* only Escape (cancel) and Enter (apply) while rotating the selection */
+                    if (k == SDLK_ESCAPE) rotate_end();
+                    else if (k == SDLK_RETURN) rotate_commit();
+                    mouse_down = 0;
+                } else if (mouse_down) {
+                    /* keep edits atomic: mid-drag only Escape is handled (cancels a shape, ends a stroke) */
+                    if (k == SDLK_ESCAPE) {
+                        if (!shape_active && !selecting) edit_end();
+                        shape_active = selecting = 0;
+                        mouse_down = 0;
+                    }
+                } else if (k == SDLK_ESCAPE && browser) browser = 0;
+                else if (k == SDLK_ESCAPE) running = 0;
+                else if (k == SDLK_F2) {
+                    if (ws.count > 0) browser = !browser;
+                    else printf("No workspace open (--workspace dir)\n");
+                } else if (browser && (k == SDLK_PAGEDOWN || k == SDLK_PAGEUP)) {
+                    ViewState view = current_view();
+                    browser_scroll(k == SDLK_PAGEDOWN ? browser_rows(&view) - 1 : 1 - browser_rows(&view));
+                }
+                else if (ctrl && k == SDLK_z) undo();
+                else if (ctrl && k == SDLK_y) redo();
+                else if (k == SDLK_c) {
+                    edit_begin();
+                    clear_canvas();
+                    edit_end();
+                } else if (k == SDLK_m) symmetry = (symmetry + 1) % 4;
+                else if (ctrl && k == SDLK_n) {
+                    char line[256];
+                    int nw = CELLS_X, nh = CELLS_Y;
+                    printf("New canvas size (width height, empty keeps %dx%d): ", CELLS_X, CELLS_Y);
+                    if (fgets(line, sizeof(line), stdin)) {
+                        sscanf(line, "%d %d", &nw, &nh);
+                        if (!dims_valid(nw, nh)) printf("Canvas size must be 1..%d cells per side\n", CELLS_SIDE_MAX);
+                        else if (doc_new(nw, nh) == 0) { fit_preview(); doc_title(win); }
+                        else if (doc_count == DOC_MAX) printf("Cannot open another document (at most %d)\n", DOC_MAX);
+                        else printf("Failed to allocate a %dx%d canvas\n", nw, nh);
+                    }
+                } else if (ctrl && k == SDLK_w) {
+                    if (doc_close() == 0) { fit_preview(); doc_title(win); }
+                    else printf("The last document stays open\n");
+                } else if (ctrl && k == SDLK_p) {
+                    char line[256];
+                    printf("Open from workspace (name or number 1-%d): ", ws.count);
+                    if (ws.count > 0 && fgets(line, sizeof(line), stdin)) {
+                        size_t ln = strlen(line); if (ln && line[ln-1]=='\n') line[ln-1]='\0';
+                        int e = atoi(line) - 1;
+                        for (int j=0; e < 0 && j<ws.count; j++) if (strcmp(ws.entries[j].name, line) == 0) e = j;
+                        if (ws_open(e) == 0) { fit_preview(); doc_title(win); }
+                        else printf("Failed to open %s\n", line);
+                    }
+                } else if (k == SDLK_PAGEDOWN || k == SDLK_PAGEUP) {
+                    /* step through the workspace in name order */
+                    if (ws.count > 0) {
+                        int e = docs[doc_cur].ws_entry;
+                        e = e < 0 ? 0 : (e + (k == SDLK_PAGEDOWN ? 1 : ws.count - 1)) % ws.count;
+                        if (ws_open(e) == 0) { fit_preview(); doc_title(win); }
+                        else printf("Failed to open %s\n", ws.entries[e].name);
+                    }
+                } else if (k == SDLK_TAB) {
+                    doc_switch((doc_cur + (shift ? doc_count - 1 : 1)) % doc_count);
+                    fit_preview();
+                    doc_title(win);
+                } else if (k == SDLK_w) tile_mode = !tile_mode;
+                else if (k == SDLK_a) {
+                    if (!preview_win) printf("Preview window unavailable\n");
+                    else set_preview((preview_scale + 1) % (PREVIEW_SCALE_MAX + 1));
+                }
+                else if (ctrl && k == SDLK_b) {
+                    if (capture_custom_brush() == 0) use_custom_brush = 1;
+                } else if (k == SDLK_o) {
+                    if (rotate_begin() != 0) rotate_end();
+                } else if (k == SDLK_p) current_tool = TOOL_PENCIL;
+                else if (k == SDLK_q) current_tool = TOOL_SELECT;
+                else if (k == SDLK_f) {
+                    if (shift) fill_mode = (fill_mode + 1) % 3;
+                    current_tool = TOOL_FILL;
+                } else if (k == SDLK_COMMA) { if (dither_level > 0) dither_level--; }
+                else if (k == SDLK_PERIOD) { if (dither_level < 16) dither_level++; }
+                else if (k == SDLK_n) current_tool = TOOL_LINE;
+                else if (!ctrl && k == SDLK_r) { current_tool = TOOL_RECT; shape_filled = shift; }
+                else if (k == SDLK_e) { current_tool = TOOL_ELLIPSE; shape_filled = shift; }
                 else if (k == SDLK_g) show_grid = !show_grid;
-                else if (k == SDLK_s) {
+                else if (k == SDLK_MINUS) {
+                    if (brush_radius > 0) brush_radius--;
+                    rebuild_brush_stamp();
+                } else if (k == SDLK_EQUALS) {
+                    if (brush_radius < BRUSH_MAX_RADIUS) brush_radius++;
+                    rebuild_brush_stamp();
+                } else if (k == SDLK_b) {
+                    if (use_custom_brush) use_custom_brush = 0;
+                    else brush_shape = (brush_shape == BRUSH_ROUND) ? BRUSH_SQUARE : BRUSH_ROUND;
+                    rebuild_brush_stamp();
+                } else if (k == SDLK_x) {
+                    export_filter = (export_filter + 1) % FILTER_COUNT;
+                    printf("Export filter: %s\n", filter_names[export_filter]);
+                } else if (k == SDLK_s) {
                     char fname[256];
                     printf("Save filename (example out.bmp): ");
                     if (fgets(fname, sizeof(fname), stdin)) {
@@ -278,23 +5051,62 @@ int main(int argc, char **argv) {
                             else printf("Failed to save %s\n", fname);
                         }
                     }
+                } else if (k == SDLK_i && shift) {
+                    ref_mode = (ref_mode + 1) % REF_MODE_COUNT;
+                    printf("Reference image: %s\n", ref_mode_names[ref_mode]);
+                } else if (k == SDLK_i) {
+                    char fname[256];
+                    printf("Reference BMP filename (empty removes it): ");
+                    if (fgets(fname, sizeof(fname), stdin)) {
+                        size_t ln = strlen(fname); if (ln && fname[ln-1]=='\n') fname[ln-1]='\0';
+                        if (strlen(fname) == 0) reference_clear();
+                        else if (reference_load(fname) == 0) printf("Reference %s\n", fname);
+                        else printf("Failed to load %s\n", fname);
+                    }
                 } else if (k == SDLK_l) {
                     char fname[256];
                     printf("Load BMP filename: ");
                     if (fgets(fname, sizeof(fname), stdin)) {
                         size_t ln = strlen(fname); if (ln && fname[ln-1]=='\n') fname[ln-1]='\0';
                         if (strlen(fname) > 0) {
-                            if (load_bmp_to_canvas(fname) == 0) printf("Loaded %s\n", fname);
-                            else printf("Failed to load %s\n", fname);
+                            edit_begin();
+                            if (load_bmp_to_canvas(fname) == 0) {
+                                printf("Loaded %s\n", fname);
+                                snprintf(docs[doc_cur].name, sizeof(docs[doc_cur].name), "%s", fname);
+                                doc_title(win);
+                            } else printf("Failed to load %s\n", fname);
+                            edit_end();
                         }
                     }
-                } else if (k == SDLK_LEFTBRACKET) {
-                    if (CELL_SIZE > 4) CELL_SIZE -= 1;
-                    /* recreate window size */
-                    SDL_SetWindowSize(win, CELLS_X * CELL_SIZE + 200, CELLS_Y * CELL_SIZE + 20);
-                } else if (k == SDLK_RIGHTBRACKET) {
-                    CELL_SIZE += 1;
-                    SDL_SetWindowSize(win, CELLS_X * CELL_SIZE + 200, CELLS_Y * CELL_SIZE + 20);
+                } else if (k == SDLK_h || k == SDLK_v || k == SDLK_t ||
+                           (ctrl && (k == SDLK_LEFT || k == SDLK_RIGHT || k == SDLK_UP || k == SDLK_DOWN))) {
+                    int step = shift ? 8 : 1;
+                    edit_begin();
+                    if (k == SDLK_h) flip_horizontal();
+                    else if (k == SDLK_v) flip_vertical();
+                    else if (k == SDLK_t) rotate_90(!shift);
+                    else if (k == SDLK_LEFT) shift_wrap(-step, 0);
+                    else if (k == SDLK_RIGHT) shift_wrap(step, 0);
+                    else if (k == SDLK_UP) shift_wrap(0, -step);
+                    else shift_wrap(0, step);
+                    edit_end();
+                    fit_preview();
+                } else if (ctrl && k == SDLK_r) {
+                    char line[256];
+                    int nw, nh, anchor = 5;
+                    printf("Resize canvas to (width height [anchor 1-9, 5 = center]): ");
+                    if (fgets(line, sizeof(line), stdin) && sscanf(line, "%d %d %d", &nw, &nh, &anchor) >= 2) {
+                        if (anchor < 1 || anchor > 9) anchor = 5;
+                        if (!dims_valid(nw, nh)) printf("Canvas size must be 1..%d cells per side\n", CELLS_SIDE_MAX);
+                        else if (resize_canvas(nw, nh, anchor - 1) == 0) {
+                            printf("Canvas is now %dx%d\n", CELLS_X, CELLS_Y);
+                            fit_preview();
+                        } else printf("Failed to resize canvas\n");
+                    }
+                } else if (k == SDLK_LEFTBRACKET || k == SDLK_RIGHTBRACKET) {
+                    /* zoom about the middle of the canvas area */
+                    ViewState view = current_view();
+                    zoom_at(k == SDLK_RIGHTBRACKET ? 1 : -1, view_area_w(&view) / 2.0, view_h / 2.0);
                 } else if (k >= SDLK_0 && k <= SDLK_9) {
                     int n = (k - SDLK_0);
                     if (n >=0 && n < PALETTE_COUNT) current_color = n;
@@ -302,19 +5114,54 @@ int main(int argc, char **argv) {
             }
         }
 
-        SDL_SetRenderDrawColor(ren, 220, 220, 220, 255);
-        SDL_RenderClear(ren);
-
-        draw_canvas_to_renderer(ren);
-        draw_palette_ui(ren, win_w, win_h);
-
-        SDL_RenderPresent(ren);
-        SDL_Delay(16);
+        if (browser) thumbs_schedule();
+        /* one frame in flight at most; until the renderer takes it, edits keep coalescing */
+        if (SDL_AtomicGet(&rq.frames) == 0) publish_frame();
+        if (!render) {
+            if (render_drain() > 0) render_frame(ren, rq.pren);
+            SDL_Delay(16);
+        }
     }
 
-    if (canvas) free(canvas);
-    SDL_DestroyRenderer(ren);
+    thumbs_finish();
+    journal_close();
+    doc_store();
+    for (int i=0;i<doc_count;i++) arena_free(&docs[i].arena); /* canvases, histories */
+    arena_pool_free();
+    free(ws.entries);
+    free(row_min);
+    free(row_max);
+    free(spans);
+    free(fill_seen);
+    free(fill_stack);
+    free(pattern_rows);
+    free(custom_brush.pixels);
+    free(custom_brush.runs);
+    free(edit_tiles);
+    free(edit_before);
+    free(edit_after);
+    free(edit_snap);
+    scratch_report();
+    scratch_free();
+    rotate_end();
+    if (ref_pending) SDL_FreeSurface(ref_pending);
+    if (render) {
+        RenderCmd quit;
+        memset(&quit, 0, sizeof(quit));
+        quit.type = RCMD_QUIT;
+        while (rq_push(&quit) != 0) SDL_Delay(1);
+        SDL_SemPost(rq.wake);
+        SDL_WaitThread(render, NULL);
+        SDL_DestroySemaphore(rq.wake);
+        SDL_DestroySemaphore(rq.ready);
+    } else {
+        render_release();
+        if (rq.pren) SDL_DestroyRenderer(rq.pren);
+        SDL_DestroyRenderer(ren);
+    }
+    if (preview_win) SDL_DestroyWindow(preview_win);
     SDL_DestroyWindow(win);
+    jobs_shutdown();
     SDL_Quit();
     return 0;
 }